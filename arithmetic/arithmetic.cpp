@@ -1,7 +1,14 @@
 
 #include <vector>
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <atomic>
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include "gwnum.h"
+#include "gwbench.h"
 #include "cpuid.h"
 #include "arithmetic.h"
 #include "exception.h"
@@ -10,6 +17,75 @@ gwnum convert_factor = NULL;
 
 namespace arithmetic
 {
+    gwnum GWNumPool::alloc()
+    {
+        gwnum res;
+        if (!_free.empty())
+        {
+            res = _free.back();
+            _free.pop_back();
+            FFT_state(res) = NOT_FFTed;
+            unnorms(res) = 0.0f;
+            _hits++;
+        }
+        else
+        {
+            res = gwalloc(_gwdata);
+            if (res == nullptr)
+                throw ArithmeticException();
+            _misses++;
+        }
+        _used++;
+        if (_peak < _used + _free.size())
+            _peak = _used + _free.size();
+        return res;
+    }
+
+    void GWNumPool::free(gwnum a)
+    {
+        if (_used > 0)
+            _used--;
+        if ((int)_free.size() < max_free)
+            _free.push_back(a);
+        else
+            gwfree(_gwdata, a);
+    }
+
+    void GWNumPool::release()
+    {
+        if (_used > 0)
+            _used--;
+    }
+
+    void GWNumPool::adopt()
+    {
+        _used++;
+        if (_peak < _used + _free.size())
+            _peak = _used + _free.size();
+    }
+
+    void GWNumPool::reserve(int count)
+    {
+        if (max_free < count)
+            max_free = count;
+        while ((int)_free.size() < count)
+        {
+            gwnum a = gwalloc(_gwdata);
+            if (a == nullptr)
+                throw ArithmeticException();
+            _free.push_back(a);
+        }
+        if (_peak < _used + _free.size())
+            _peak = _used + _free.size();
+    }
+
+    void GWNumPool::clear()
+    {
+        for (auto a : _free)
+            gwfree(_gwdata, a);
+        _free.clear();
+    }
+
     void GWState::init()
     {
         if (N)
@@ -60,6 +136,13 @@ namespace arithmetic
         init();
         if (k >= (1ULL << 51) || b >= (1ULL << 32) || n >= (1ULL << 32) || abs(c) >= (1ULL << 30))
             throw ArithmeticException();
+        bool use_cache = setup_cache != nullptr && next_fft_count == 0 && !information_only;
+        if (use_cache)
+        {
+            int cached_fft_length = setup_cache->find(*this, k, b, n, c);
+            if (cached_fft_length > 0)
+                gwset_specific_fftlen(gwdata(), cached_fft_length);
+        }
         if (gwsetup(gwdata(), (double)k, (uint32_t)b, (uint32_t)n, (int32_t)c))
             throw ArithmeticException();
         bit_length = (int)gwdata()->bit_length;
@@ -81,6 +164,9 @@ namespace arithmetic
         gwfft_description(gwdata(), buf);
         fft_description = buf;
         fft_length = gwfftlen(gwdata());
+        pool.reset(new GWNumPool(gwdata()));
+        if (use_cache)
+            setup_cache->update(*this, k, b, n, c);
     }
 
     void GWState::setup(const Giant& g)
@@ -105,6 +191,7 @@ namespace arithmetic
         gwfft_description(gwdata(), buf);
         fft_description = buf;
         fft_length = gwfftlen(gwdata());
+        pool.reset(new GWNumPool(gwdata()));
     }
 
     void GWState::setup(int bitlen)
@@ -120,6 +207,7 @@ namespace arithmetic
         gwfft_description(gwdata(), buf);
         fft_description = buf;
         fft_length = gwfftlen(gwdata());
+        pool.reset(new GWNumPool(gwdata()));
     }
 
     void GWState::clone(GWState& state)
@@ -136,11 +224,14 @@ namespace arithmetic
         fft_description = state.fft_description;
         fft_length = state.fft_length;
         mod_gwstate.reset();
+        pool.reset(new GWNumPool(gwdata()));
+        pool->max_free = state.pool ? state.pool->max_free : pool->max_free;
     }
 
     void GWState::done()
     {
         mod_gwstate.reset();
+        pool.reset();
         N.reset();
         giants.reset();
         fft_description.clear();
@@ -150,6 +241,139 @@ namespace arithmetic
         convert_factor = NULL;
     }
 
+    std::string GWSetupCache::signature()
+    {
+        return std::string(GWNUM_VERSION) + "/" + GWNUM_FFT_IMPL_VERSION + "/" + std::to_string(CPU_SIGNATURE) + "/" + std::to_string(CPU_FLAGS) + "/" + CPU_BRAND;
+    }
+
+    bool GWSetupCache::load()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _entries.clear();
+        FILE* file = fopen(_filename.data(), "r");
+        if (file == nullptr)
+            return false;
+        char buf[256];
+        std::string sig = signature();
+        if (fgets(buf, sizeof(buf), file) == nullptr || sig != std::string(buf, strcspn(buf, "\r\n")))
+        {
+            // Different gwnum version or CPU, the cache is stale.
+            fclose(file);
+            _modified = true;
+            return false;
+        }
+        Entry e;
+        while (fscanf(file, "%llu %llu %llu %lld %d %d %lf %d %lf", (unsigned long long*)&e.k, (unsigned long long*)&e.b, (unsigned long long*)&e.n_bucket, (long long*)&e.c, &e.cpu_flags, &e.thread_count, &e.safety_margin, &e.fft_length, &e.ms_per_mul) == 9)
+            _entries.push_back(e);
+        fclose(file);
+        _modified = false;
+        return true;
+    }
+
+    void GWSetupCache::save()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_modified)
+            return;
+        FILE* file = fopen(_filename.data(), "w");
+        if (file == nullptr)
+            return;
+        fprintf(file, "%s\n", signature().data());
+        for (auto& e : _entries)
+            fprintf(file, "%llu %llu %llu %lld %d %d %g %d %g\n", (unsigned long long)e.k, (unsigned long long)e.b, (unsigned long long)e.n_bucket, (long long)e.c, e.cpu_flags, e.thread_count, e.safety_margin, e.fft_length, e.ms_per_mul);
+        fclose(file);
+        _modified = false;
+    }
+
+    bool GWSetupCache::match(const Entry& e, GWState& state, uint64_t k, uint64_t b, uint64_t n, int64_t c)
+    {
+        return e.k == k && e.b == b && e.n_bucket == (n >> n_bucket_bits) && e.c == c && e.cpu_flags == state.gwdata()->cpu_flags && e.thread_count == state.thread_count && e.safety_margin == state.safety_margin;
+    }
+
+    int GWSetupCache::find(GWState& state, uint64_t k, uint64_t b, uint64_t n, int64_t c)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        const Entry* best = nullptr;
+        for (auto& e : _entries)
+            if (match(e, state, k, b, n, c) && (best == nullptr || e.ms_per_mul < best->ms_per_mul))
+                best = &e;
+        // gwsetup treats the cached length as a minimum, so a length too small for n is skipped safely.
+        return best != nullptr ? best->fft_length : 0;
+    }
+
+    void GWSetupCache::update(GWState& state, uint64_t k, uint64_t b, uint64_t n, int64_t c)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (auto& e : _entries)
+                if (match(e, state, k, b, n, c) && e.fft_length == state.fft_length)
+                    return;
+        }
+        Entry e;
+        e.k = k;
+        e.b = b;
+        e.n_bucket = n >> n_bucket_bits;
+        e.c = c;
+        e.cpu_flags = state.gwdata()->cpu_flags;
+        e.thread_count = state.thread_count;
+        e.safety_margin = state.safety_margin;
+        e.fft_length = state.fft_length;
+        e.ms_per_mul = benchmark(state, bench_count);
+        std::vector<Entry> neighbors;
+        for (int i = 1; i <= bench_neighbors; i++)
+        {
+            GWState neighbor;
+            neighbor.copy(state);
+            neighbor.setup_cache = nullptr;
+            neighbor.next_fft_count = i;
+            try
+            {
+                neighbor.setup(k, b, n, c);
+            }
+            catch (const ArithmeticException&)
+            {
+                break;
+            }
+            neighbors.push_back(e);
+            neighbors.back().fft_length = neighbor.fft_length;
+            neighbors.back().ms_per_mul = benchmark(neighbor, bench_count);
+        }
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _entries.push_back(e);
+        for (auto& neighbor : neighbors)
+        {
+            bool found = false;
+            for (auto& cur : _entries)
+                if (match(cur, state, k, b, n, c) && cur.fft_length == neighbor.fft_length)
+                    found = true;
+            if (!found)
+                _entries.push_back(neighbor);
+        }
+        _modified = true;
+    }
+
+    double GWSetupCache::benchmark(GWState& state, int count)
+    {
+        if (count <= 0)
+            return 0;
+        uint64_t fft_count = gw_get_fft_count(state.gwdata());
+        double timer;
+        {
+            GWArithmetic gw(state);
+            GWNum X(gw);
+            X = 3;
+            for (int i = 0; i < 5; i++)
+                gw.mul(X, X, X, GWMUL_STARTNEXTFFT);
+            timer = getHighResTimer();
+            for (int i = 0; i < count; i++)
+                gw.mul(X, X, X, GWMUL_STARTNEXTFFT);
+            timer = (getHighResTimer() - timer)/getHighResTimerFrequency();
+        }
+        state.gwdata()->fft_count = fft_count;
+        return timer*1000/count;
+    }
+
     void GWState::mod(arithmetic::Giant& a, arithmetic::Giant& res)
     {
         if (!mod_gwstate)
@@ -196,12 +420,23 @@ namespace arithmetic
 
     void GWArithmetic::alloc(GWNum& a)
     {
-        a._gwnum = gwalloc(gwdata());
+        if (_state.pool)
+            a._gwnum = _state.pool->alloc();
+        else
+            a._gwnum = gwalloc(gwdata());
     }
 
     void GWArithmetic::free(GWNum& a)
     {
-        gwfree(gwdata(), a._gwnum);
+        if (_auto_flags)
+        {
+            _consumers.erase(*a);
+            _auto_ffted.erase(*a);
+        }
+        if (_state.pool)
+            _state.pool->free(a._gwnum);
+        else
+            gwfree(gwdata(), a._gwnum);
         a._gwnum = nullptr;
     }
 
@@ -254,6 +489,74 @@ namespace arithmetic
         return _state.giants->cmp(popg() = a, b);
     }
 
+    bool GWArithmetic::eq(const GWNum& a, const GWNum& b)
+    {
+        if (&a == &b || *a == *b)
+            return true;
+        int ret = eq_words(a, &b, 0);
+        if (ret >= 0)
+            return ret == 1;
+        return cmp(a, b) == 0;
+    }
+
+    bool GWArithmetic::eq(const GWNum& a, int32_t b)
+    {
+        int ret = eq_words(a, nullptr, b);
+        if (ret >= 0)
+            return ret == 1;
+        return cmp(a, b) == 0;
+    }
+
+    // Compares a with b (or with the constant c if b is null) using FFT words directly.
+    // The difference D of the word values is reduced modulo the fingerprint modulus and checked against
+    // the few multiples of N allowed by its magnitude. Returns 1 if equal, 0 if not equal, -1 if undecided.
+    int GWArithmetic::eq_words(const GWNum& a, const GWNum* b, int32_t c)
+    {
+        gwhandle* gwdata = this->gwdata();
+        if (!_state.N || _state.need_mod() || gwdata->b != 2 || gwdata->GENERAL_MOD)
+            return -1;
+        if (FFT_state(*a) != NOT_FFTed || (b != nullptr && FFT_state(**b) != NOT_FFTed))
+            return -1;
+
+        const uint64_t m = 3417905339ULL;
+        int bitlen = _state.N->bitlen();
+        unsigned long limit = gwdata->ZERO_PADDED_FFT ? gwdata->FFTLEN/2 + 4 : gwdata->FFTLEN;
+        bool equal = true;
+        uint64_t D = 0;
+        uint64_t pow = 1;
+        double bound = 0;
+        int pos = 0;
+        for (unsigned long i = 0; i < limit; i++)
+        {
+            long va, vb;
+            if (get_fft_value(gwdata, *a, i, &va))
+                return -1;
+            if (b == nullptr)
+                vb = i == 0 ? c : 0;
+            else if (get_fft_value(gwdata, **b, i, &vb))
+                return -1;
+            int bits = gwdata->NUM_B_PER_SMALL_WORD + (is_big_word(gwdata, i) ? 1 : 0);
+            if (va != vb)
+            {
+                int64_t d = (int64_t)va - vb;
+                equal = false;
+                D = (D + (d < 0 ? m - (uint64_t)(-d)%m : (uint64_t)d%m)*pow)%m;
+                bound += ldexp((double)std::abs(d), pos - bitlen);
+            }
+            pow = pow*((1ULL << bits)%m)%m;
+            pos += bits;
+        }
+        if (equal)
+            return 1;
+        // bound >= |D|/2^bitlen and N >= 2^(bitlen - 1), so D = j*N has |j| <= 2*bound.
+        if (bound > 500)
+            return -1;
+        for (int64_t j = -2*(int64_t)bound - 1; j <= 2*(int64_t)bound + 1; j++)
+            if (D == (j < 0 ? m - (uint64_t)(-j)*_state.fingerprint%m : (uint64_t)j*_state.fingerprint%m)%m)
+                return -1;
+        return 0;
+    }
+
     void GWArithmetic::add(GWNum& a, GWNum& b, GWNum& res)
     {
         add(a, b, res, GWADD_DELAY_NORMALIZE);
@@ -268,6 +571,8 @@ namespace arithmetic
 
     void GWArithmetic::add(GWNum& a, GWNum& b, GWNum& res, int options)
     {
+        if (_auto_flags)
+            options = auto_add_options(options, a, b);
         gwadd3o(gwdata(), *a, *b, *res, options);
     }
 
@@ -285,6 +590,8 @@ namespace arithmetic
 
     void GWArithmetic::sub(GWNum& a, GWNum& b, GWNum& res, int options)
     {
+        if (_auto_flags)
+            options = auto_add_options(options, a, b);
         gwsub3o(gwdata(), *a, *b, *res, options);
     }
 
@@ -309,6 +616,8 @@ namespace arithmetic
 
     void GWArithmetic::mul(GWNum& a, GWNum& b, GWNum& res, int options)
     {
+        if (_auto_flags)
+            options = auto_mul_options(options, res, &a, &b);
         gwmul3(gwdata(), *a, *b, *res, options);
     }
 
@@ -319,31 +628,43 @@ namespace arithmetic
 
     void GWArithmetic::addmul(GWNum& a, GWNum& b, GWNum& c, GWNum& res, int options)
     {
+        if (_auto_flags)
+            options = auto_mul_options(options, res, &a, &b, &c);
         gwaddmul4(gwdata(), *a, *b, *c, *res, options);
     }
 
     void GWArithmetic::submul(GWNum& a, GWNum& b, GWNum& c, GWNum& res, int options)
     {
+        if (_auto_flags)
+            options = auto_mul_options(options, res, &a, &b, &c);
         gwsubmul4(gwdata(), *a, *b, *c, *res, options);
     }
 
     void GWArithmetic::muladd(GWNum& a, GWNum& b, GWNum& c, GWNum& res, int options)
     {
+        if (_auto_flags)
+            options = auto_mul_options(options, res, &a, &b, &c);
         gwmuladd4(gwdata(), *a, *b, *c, *res, options);
     }
 
     void GWArithmetic::mulsub(GWNum& a, GWNum& b, GWNum& c, GWNum& res, int options)
     {
+        if (_auto_flags)
+            options = auto_mul_options(options, res, &a, &b, &c);
         gwmulsub4(gwdata(), *a, *b, *c, *res, options);
     }
 
     void GWArithmetic::mulmuladd(GWNum& a, GWNum& b, GWNum& c, GWNum& d, GWNum& res, int options)
     {
+        if (_auto_flags)
+            options = auto_mul_options(options, res, &a, &b, &c, &d);
         gwmulmuladd5(gwdata(), *a, *b, *c, *d, *res, options);
     }
 
     void GWArithmetic::mulmulsub(GWNum& a, GWNum& b, GWNum& c, GWNum& d, GWNum& res, int options)
     {
+        if (_auto_flags)
+            options = auto_mul_options(options, res, &a, &b, &c, &d);
         gwmulmulsub5(gwdata(), *a, *b, *c, *d, *res, options);
     }
 
@@ -391,6 +712,82 @@ namespace arithmetic
         ((popg() = a)%(popg() = b)).to_GWNum(res);
     }
 
+    void GWArithmetic::set_auto_flags(bool value)
+    {
+        _auto_flags = value;
+        if (!value)
+        {
+            _consumers.clear();
+            _auto_ffted.clear();
+        }
+    }
+
+    void GWArithmetic::expect(GWNum& a, int count)
+    {
+        _consumers[*a] = count;
+    }
+
+    int GWArithmetic::auto_mul_options(int options, GWNum& res, GWNum* s1, GWNum* s2, GWNum* s3, GWNum* s4)
+    {
+        GWNum* sources[4] = { s1, s2, s3, s4 };
+        for (int i = 0; i < 4 && sources[i] != nullptr; i++)
+        {
+            gwnum s = **sources[i];
+            int fft_flag = GWMUL_FFT_S1 << (2*i);
+            int preserve_flag = GWMUL_PRESERVE_S1 << (2*i);
+            // A repeated source (square) is one use, it follows the flag of its first occurrence.
+            int j;
+            for (j = 0; j < i && **sources[j] != s; j++);
+            if (j < i)
+            {
+                if (options & (GWMUL_FFT_S1 << (2*j)))
+                    options |= fft_flag;
+                else
+                    options &= ~fft_flag;
+                continue;
+            }
+            auto it = _consumers.find(s);
+            if (FFT_state(s) != NOT_FFTed)
+            {
+                if (_auto_ffted.count(s) != 0)
+                    _avoided_ffts++;
+            }
+            else if (!(options & preserve_flag) && (it == _consumers.end() || it->second > 1))
+            {
+                // Keep the forward FFT in place, the source is going to be used again.
+                if (!(options & fft_flag))
+                    _auto_ffted.insert(s);
+                options |= fft_flag;
+            }
+            else if (it != _consumers.end() && it->second <= 1)
+                options &= ~fft_flag;
+            if (it != _consumers.end() && it->second > 0)
+                it->second--;
+        }
+
+        _auto_ffted.erase(*res);
+        auto it = _consumers.find(*res);
+        if (it != _consumers.end())
+        {
+            if (it->second > 0 && !gwdata()->GENERAL_MOD)
+                options |= GWMUL_STARTNEXTFFT;
+            else
+            {
+                options &= ~GWMUL_STARTNEXTFFT;
+                _consumers.erase(it);
+            }
+        }
+        return options;
+    }
+
+    int GWArithmetic::auto_add_options(int options, GWNum& a, GWNum& b)
+    {
+        if (options & (GWADD_FORCE_NORMALIZE | GWADD_GUARANTEED_OK))
+            return options;
+        options &= ~GWADD_DELAY_NORMALIZE;
+        return options | GWADD_DELAYNORM_IF(square_safe(gwdata(), unnorms(*a) + unnorms(*b) + 1));
+    }
+
     const GWNumWrapper GWArithmetic::wrap(gwnum a)
     {
         return GWNumWrapper(*this, a);
@@ -531,23 +928,83 @@ namespace arithmetic
         _suspect_ops.clear();
         _restart_flag = false;
         _failure_flag = false;
+        _check_period = 1;
+        _check_countdown = 1;
+        _low_checks = 0;
     }
 
     void ReliableGWArithmetic::restart(int op)
     {
         _op = op;
+        _suspect_ops.seek(op);
         _restart_flag = false;
+        _check_period = 1;
+        _check_countdown = 1;
+        _low_checks = 0;
+    }
+
+    void ReliableGWArithmetic::set_sampling(bool value, int max_check_period)
+    {
+        _sampling = value;
+        _max_check_period = max_check_period;
+        _check_period = 1;
+        _check_countdown = 1;
+        _low_checks = 0;
+    }
+
+    void ReliableGWArithmetic::adapt_sampling()
+    {
+        if (!_sampling)
+            return;
+        double maxerr = gw_get_maxerr(gwdata());
+        if (maxerr > _max_roundoff*0.6)
+        {
+            // Roundoff is getting close to the limit, check every operation.
+            _check_period = 1;
+            _low_checks = 0;
+        }
+        else if (maxerr < _max_roundoff*0.4 && ++_low_checks >= 16 && _check_period < _max_check_period)
+        {
+            _check_period *= 2;
+            _low_checks = 0;
+        }
+        _check_countdown = _check_period;
+    }
+
+    void SuspectOps::seek(int op)
+    {
+        _cursor = std::lower_bound(_ops.begin(), _ops.end(), op) - _ops.begin();
+    }
+
+    void SuspectOps::insert(int op)
+    {
+        seek(op);
+        if (_cursor == _ops.size() || _ops[_cursor] != op)
+            _ops.insert(_ops.begin() + _cursor, op);
+    }
+
+    void SuspectOps::erase(int op)
+    {
+        seek(op);
+        if (_cursor < _ops.size() && _ops[_cursor] == op)
+            _ops.erase(_ops.begin() + _cursor);
     }
 
     void ReliableGWArithmetic::mul(GWNum& a, GWNum& b, GWNum& res, int options)
     {
-        bool suspect = _suspect_ops.count(_op) != 0;
-        if (!suspect)
+        if (_auto_flags)
+            options = auto_mul_options(options, res, &a, &b);
+        bool suspect = _suspect_ops.check(_op);
+        bool checked = suspect || sample();
+        if (!checked)
+            gwmul3(gwdata(), *a, *b, *res, options);
+        if (checked && !suspect)
         {
             // Try a normal operation.
             gwerror_checking(gwdata(), true);
             gwmul3(gwdata(), *a, *b, *res, options);
             gwerror_checking(gwdata(), false);
+            adapt_sampling();
             if (gw_get_maxerr(gwdata()) > _max_roundoff)
             {
                 // If roundoff exceeds maximum, mark the operation as suspect.
@@ -593,12 +1050,18 @@ namespace arithmetic
 
     void ReliableGWArithmetic::addmul(GWNum& a, GWNum& b, GWNum& c, GWNum& res, int options)
     {
-        bool suspect = _suspect_ops.count(_op) != 0;
-        if (!suspect)
+        if (_auto_flags)
+            options = auto_mul_options(options, res, &a, &b, &c);
+        bool suspect = _suspect_ops.check(_op);
+        bool checked = suspect || sample();
+        if (!checked)
+            gwaddmul4(gwdata(), *a, *b, *c, *res, options);
+        if (checked && !suspect)
         {
             gwerror_checking(gwdata(), true);
             gwaddmul4(gwdata(), *a, *b, *c, *res, options);
             gwerror_checking(gwdata(), false);
+            adapt_sampling();
             if (gw_get_maxerr(gwdata()) > _max_roundoff)
             {
                 gw_clear_maxerr(gwdata());
@@ -640,12 +1103,18 @@ namespace arithmetic
 
     void ReliableGWArithmetic::submul(GWNum& a, GWNum& b, GWNum& c, GWNum& res, int options)
     {
-        bool suspect = _suspect_ops.count(_op) != 0;
-        if (!suspect)
+        if (_auto_flags)
+            options = auto_mul_options(options, res, &a, &b, &c);
+        bool suspect = _suspect_ops.check(_op);
+        bool checked = suspect || sample();
+        if (!checked)
+            gwsubmul4(gwdata(), *a, *b, *c, *res, options);
+        if (checked && !suspect)
         {
             gwerror_checking(gwdata(), true);
             gwsubmul4(gwdata(), *a, *b, *c, *res, options);
             gwerror_checking(gwdata(), false);
+            adapt_sampling();
             if (gw_get_maxerr(gwdata()) > _max_roundoff)
             {
                 gw_clear_maxerr(gwdata());
@@ -687,12 +1156,18 @@ namespace arithmetic
 
     void ReliableGWArithmetic::muladd(GWNum& a, GWNum& b, GWNum& c, GWNum& res, int options)
     {
-        bool suspect = _suspect_ops.count(_op) != 0;
-        if (!suspect)
+        if (_auto_flags)
+            options = auto_mul_options(options, res, &a, &b, &c);
+        bool suspect = _suspect_ops.check(_op);
+        bool checked = suspect || sample();
+        if (!checked)
+            gwmuladd4(gwdata(), *a, *b, *c, *res, options);
+        if (checked && !suspect)
         {
             gwerror_checking(gwdata(), true);
             gwmuladd4(gwdata(), *a, *b, *c, *res, options);
             gwerror_checking(gwdata(), false);
+            adapt_sampling();
             if (gw_get_maxerr(gwdata()) > _max_roundoff)
             {
                 gw_clear_maxerr(gwdata());
@@ -735,12 +1210,18 @@ namespace arithmetic
 
     void ReliableGWArithmetic::mulsub(GWNum& a, GWNum& b, GWNum& c, GWNum& res, int options)
     {
-        bool suspect = _suspect_ops.count(_op) != 0;
-        if (!suspect)
+        if (_auto_flags)
+            options = auto_mul_options(options, res, &a, &b, &c);
+        bool suspect = _suspect_ops.check(_op);
+        bool checked = suspect || sample();
+        if (!checked)
+            gwmulsub4(gwdata(), *a, *b, *c, *res, options);
+        if (checked && !suspect)
         {
             gwerror_checking(gwdata(), true);
             gwmulsub4(gwdata(), *a, *b, *c, *res, options);
             gwerror_checking(gwdata(), false);
+            adapt_sampling();
             if (gw_get_maxerr(gwdata()) > _max_roundoff)
             {
                 gw_clear_maxerr(gwdata());
@@ -783,12 +1264,18 @@ namespace arithmetic
 
     void ReliableGWArithmetic::mulmuladd(GWNum& a, GWNum& b, GWNum& c, GWNum& d, GWNum& res, int options)
     {
-        bool suspect = _suspect_ops.count(_op) != 0;
-        if (!suspect)
+        if (_auto_flags)
+            options = auto_mul_options(options, res, &a, &b, &c, &d);
+        bool suspect = _suspect_ops.check(_op);
+        bool checked = suspect || sample();
+        if (!checked)
+            gwmulmuladd5(gwdata(), *a, *b, *c, *d, *res, options);
+        if (checked && !suspect)
         {
             gwerror_checking(gwdata(), true);
             gwmulmuladd5(gwdata(), *a, *b, *c, *d, *res, options);
             gwerror_checking(gwdata(), false);
+            adapt_sampling();
             if (gw_get_maxerr(gwdata()) > _max_roundoff)
             {
                 gw_clear_maxerr(gwdata());
@@ -830,12 +1317,18 @@ namespace arithmetic
 
     void ReliableGWArithmetic::mulmulsub(GWNum& a, GWNum& b, GWNum& c, GWNum& d, GWNum& res, int options)
     {
-        bool suspect = _suspect_ops.count(_op) != 0;
-        if (!suspect)
+        if (_auto_flags)
+            options = auto_mul_options(options, res, &a, &b, &c, &d);
+        bool suspect = _suspect_ops.check(_op);
+        bool checked = suspect || sample();
+        if (!checked)
+            gwmulmulsub5(gwdata(), *a, *b, *c, *d, *res, options);
+        if (checked && !suspect)
         {
             gwerror_checking(gwdata(), true);
             gwmulmulsub5(gwdata(), *a, *b, *c, *d, *res, options);
             gwerror_checking(gwdata(), false);
+            adapt_sampling();
             if (gw_get_maxerr(gwdata()) > _max_roundoff)
             {
                 gw_clear_maxerr(gwdata());
@@ -888,28 +1381,76 @@ namespace arithmetic
 
     void SerializedGWNum::to_GWNum(GWNum& a) const
     {
-        if (empty())
+        deserialize(_data.data(), _data.size(), a);
+    }
+
+    size_t SerializedGWNum::size(const GWNum& a)
+    {
+        int len;
+        if (gwserialize_size(a.arithmetic().gwdata(), *a, &len) != 0)
+            throw ArithmeticException();
+        return len;
+    }
+
+    void SerializedGWNum::serialize(const GWNum& a, std::function<void(const uint32_t* data, size_t size)> output, size_t block_size)
+    {
+        std::vector<uint32_t> block(block_size);
+        if (gwserialize_blocks(a.arithmetic().gwdata(), *a, block.data(), (int)block.size(), [&](const uint32_t* data, int count) { output(data, count); }) != 0)
+            throw ArithmeticException();
+    }
+
+    void SerializedGWNum::deserialize(const uint32_t* data, size_t size, GWNum& a)
+    {
+        if (size == 0)
             a = 0;
         else
-            gwdeserialize(a.arithmetic().gwdata(), _data.data(), (int)_data.size(), *a);
+            gwdeserialize(a.arithmetic().gwdata(), data, (int)size, *a);
+    }
+
+    void get_JSF(Giant& a, Giant& b, std::vector<int8_t>& res_a, std::vector<int8_t>& res_b)
+    {
+        // Solinas' joint sparse form of |a|, |b|, least significant digit first.
+        res_a.clear();
+        res_b.clear();
+        int len_a = a.bitlen();
+        int len_b = b.bitlen();
+        int d0 = 0, d1 = 0;
+        for (int i = 0; i < len_a || i < len_b || d0 != 0 || d1 != 0; i++)
+        {
+            int l0 = d0 + (a.bit(i) ? 1 : 0) + (a.bit(i + 1) ? 2 : 0) + (a.bit(i + 2) ? 4 : 0);
+            int l1 = d1 + (b.bit(i) ? 1 : 0) + (b.bit(i + 1) ? 2 : 0) + (b.bit(i + 2) ? 4 : 0);
+            int u0 = 0, u1 = 0;
+            if (l0 & 1)
+            {
+                u0 = (l0 & 3) == 1 ? 1 : -1;
+                if (((l0 & 7) == 3 || (l0 & 7) == 5) && (l1 & 3) == 2)
+                    u0 = -u0;
+            }
+            if (l1 & 1)
+            {
+                u1 = (l1 & 3) == 1 ? 1 : -1;
+                if (((l1 & 7) == 3 || (l1 & 7) == 5) && (l0 & 3) == 2)
+                    u1 = -u1;
+            }
+            if (2*d0 == 1 + u0)
+                d0 = 1 - d0;
+            if (2*d1 == 1 + u1)
+                d1 = 1 - d1;
+            res_a.push_back((int8_t)(a < 0 ? -u0 : u0));
+            res_b.push_back((int8_t)(b < 0 ? -u1 : u1));
+        }
     }
 }
 
-int gwconvert(
+static int gwconvert_words(
     gwhandle *gwdata_s,	/* Handle initialized by gwsetup */
     gwhandle *gwdata_d,	/* Handle initialized by gwsetup */
-    gwnum	s,
+    gwnum	s,          /* Source gwnum, not FFTed */
     gwnum	d)
 {
     int	err_code;
     unsigned long limit;
 
-    ASSERTG(gwdata_s->k == gwdata_d->k && gwdata_s->b == gwdata_d->b && gwdata_s->c == gwdata_d->c);
-
-    /* Make sure data is not FFTed.  Caller should really try to avoid this scenario. */
-
-    if (FFT_state(s) != NOT_FFTed) gwunfft(gwdata_s, s, s);
-
     /* Initialize the header */
 
     unnorms(d) = 0.0f;						/* Unnormalized adds count */
@@ -950,15 +1491,18 @@ int gwconvert(
         limit++;
     }
 
-    /* If base is 2 we can simply copy the bits out of each FFT word */
+    /* If base is 2 we can simply copy the bits out of each FFT word. */
+    /* Both sides are walked sequentially with iterators, which avoids */
+    /* the full address computation of get_fft_value for every word. */
 
     if (gwdata_s->b == 2) {
-        long val;
+        int32_t val;
         int64_t value;
         unsigned long i_s;
         unsigned long i_d, limit_d;
         int	bits_in_value, bits, bits1, bits2;
-        long mask1, mask2, mask1i, mask2i;
+        int32_t mask1, mask2, mask1i, mask2i;
+        gwiter iter_s, iter_d;
 
         // Figure out how many FFT words we will need to set
         limit_d = gwdata_d->FFTLEN;
@@ -966,8 +1510,8 @@ int gwconvert(
 
         bits1 = gwdata_d->NUM_B_PER_SMALL_WORD;
         bits2 = bits1 + 1;
-        mask1 = (1L << bits1) - 1;
-        mask2 = (1L << bits2) - 1;
+        mask1 = (1 << bits1) - 1;
+        mask2 = (1 << bits2) - 1;
         mask1i = ~mask1;
         mask2i = ~mask2;
 
@@ -976,33 +1520,34 @@ int gwconvert(
         value = 0;
         bits_in_value = 0;
         i_d = 0;
+        gwiter_init_write_only(gwdata_d, &iter_d, d);
 
-        for (i_s = 0; i_s < limit; i_s++) {
-            err_code = get_fft_value(gwdata_s, s, i_s, &val);
+        for (i_s = 0, gwiter_init_zero(gwdata_s, &iter_s, s); i_s < limit; i_s++, gwiter_next(&iter_s)) {
+            err_code = gwiter_get_fft_value(&iter_s, &val);
             if (err_code) return (err_code);
             bits = gwdata_s->NUM_B_PER_SMALL_WORD;
-            if (is_big_word(gwdata_s, i_s)) bits++;
+            if (gwiter_is_big_word(&iter_s)) bits++;
             value += (int64_t)val << bits_in_value;
             bits_in_value += bits;
 
-            for (; i_d < limit_d; i_d++) {
+            for (; i_d < limit_d; i_d++, gwiter_next(&iter_d)) {
                 if (i_d == limit_d - 1) {
                     if (i_s < limit - 1) break;
-                    val = (long)value;
+                    val = (int32_t)value;
                 }
                 else {
                     int	big_word;
-                    big_word = is_big_word(gwdata_d, i_d);
+                    big_word = gwiter_is_big_word(&iter_d);
                     bits = big_word ? bits2 : bits1;
                     if (i_s < limit - 1 && bits > bits_in_value) break;
                     if (value >= 0)
-                        val = (long)value & (big_word ? mask2 : mask1);
+                        val = (int32_t)value & (big_word ? mask2 : mask1);
                     else {
-                        val = (long)value | (big_word ? mask2i : mask1i);
+                        val = (int32_t)value | (big_word ? mask2i : mask1i);
                         value -= val;
                     }
                 }
-                set_fft_value(gwdata_d, d, i_d, val);
+                gwiter_set_fft_value(&iter_d, val);
                 value >>= bits;
                 bits_in_value -= bits;
             }
@@ -1010,8 +1555,8 @@ int gwconvert(
 
         /* Clear the upper words */
 
-        for (; i_d < gwdata_d->FFTLEN; i_d++) {
-            set_fft_value(gwdata_d, d, i_d, 0);
+        for (; i_d < gwdata_d->FFTLEN; i_d++, gwiter_next(&iter_d)) {
+            gwiter_set_fft_value(&iter_d, 0);
         }
     }
 
@@ -1023,6 +1568,26 @@ int gwconvert(
         return -1;
     }
 
+    return (0);
+}
+
+int gwconvert(
+    gwhandle *gwdata_s,	/* Handle initialized by gwsetup */
+    gwhandle *gwdata_d,	/* Handle initialized by gwsetup */
+    gwnum	s,
+    gwnum	d)
+{
+    int	err_code;
+
+    ASSERTG(gwdata_s->k == gwdata_d->k && gwdata_s->b == gwdata_d->b && gwdata_s->c == gwdata_d->c);
+
+    /* Make sure data is not FFTed.  Caller should really try to avoid this scenario. */
+
+    if (FFT_state(s) != NOT_FFTed) gwunfft(gwdata_s, s, s);
+
+    err_code = gwconvert_words(gwdata_s, gwdata_d, s, d);
+    if (err_code) return (err_code);
+
     /* Return success */
 
     gwdata_s->read_count += 1;
@@ -1030,39 +1595,72 @@ int gwconvert(
     return (0);
 }
 
+int gwconvert_batch(
+    gwhandle *gwdata_s,	/* Handle initialized by gwsetup */
+    gwhandle *gwdata_d,	/* Handle initialized by gwsetup */
+    gwnum	*s,         /* Array of source gwnums */
+    gwnum	*d,         /* Array of destination gwnums */
+    int count,          /* Number of gwnums to convert */
+    int threads)        /* Number of threads to use */
+{
+    ASSERTG(gwdata_s->k == gwdata_d->k && gwdata_s->b == gwdata_d->b && gwdata_s->c == gwdata_d->c);
+
+    /* Unfft uses the handle's own helper threads, do it before spreading the work */
+
+    for (int i = 0; i < count; i++)
+        if (FFT_state(s[i]) != NOT_FFTed) gwunfft(gwdata_s, s[i], s[i]);
+
+    /* The conversion itself only reads the handles, so each thread takes the next gwnum */
+
+    std::atomic<int> next(0);
+    std::atomic<int> err_code(0);
+    auto convert = [&]()
+    {
+        int i, err;
+        while (err_code == 0 && (i = next++) < count)
+            if ((err = gwconvert_words(gwdata_s, gwdata_d, s[i], d[i])) != 0)
+                err_code = err;
+    };
+    if (threads > count)
+        threads = count;
+    std::vector<std::thread> helpers;
+    for (int i = 1; i < threads; i++)
+        helpers.emplace_back(convert);
+    convert();
+    for (auto& helper : helpers)
+        helper.join();
+    if (err_code != 0) return (err_code);
+
+    gwdata_s->read_count += count;
+    gwdata_d->write_count += count;
+    return (0);
+}
+
 #define GWSERIALIZE_HEADER_SIZE 6
 #define GWSERIALIZE_FLAG_IRRATIONAL 1
 #define GWSERIALIZE_FLAG_GENERALMOD 2
 #define GWSERIALIZE_FLAG_MMGW_MOD 4
 
-int gwserialize(
+static int gwserialize_limit(
     gwhandle *gwdata,  /* Handle initialized by gwsetup */
     gwnum gg,          /* Source gwnum */
-    uint32_t *array,   /* Array to contain the serialized value */
-    int arraylen,	   /* Maximum size of the array */
-    int *arrayused)    /* Size of the serialized value */
+    unsigned long *limit) /* Number of FFT words to serialize */
 {
     int	err_code;
-    unsigned long limit;
 
 /* Make sure data is not FFTed.  Caller should really try to avoid this scenario. */
 
 	if (FFT_state (gg) != NOT_FFTed) gwunfft (gwdata, gg, gg);
 
-/* Set result to zero in case of error.  If caller does not check the returned error code */
-/* a result value of zero is less likely to cause problems/crashes. */
-
-    *arrayused = 0;
-
 /* If this is a general-purpose mod, then only convert the needed words */
 /* which will be less than half the FFT length.  If this is a zero padded */
 /* FFT, then only convert a little more than half of the FFT data words. */
 /* For a DWT, convert all the FFT data. */
 
-	if (gwdata->GENERAL_MOD) limit = gwdata->GW_GEN_MOD_MAX + 3;
-    //else if (gwdata->GENERAL_MMGW_MOD) limit = 2*gwdata->FFTLEN;
-    else if (gwdata->ZERO_PADDED_FFT) limit = gwdata->FFTLEN / 2 + 4;
-	else limit = gwdata->FFTLEN;
+	if (gwdata->GENERAL_MOD) *limit = gwdata->GW_GEN_MOD_MAX + 3;
+    //else if (gwdata->GENERAL_MMGW_MOD) *limit = 2*gwdata->FFTLEN;
+    else if (gwdata->ZERO_PADDED_FFT) *limit = gwdata->FFTLEN / 2 + 4;
+	else *limit = gwdata->FFTLEN;
 
 /* GENERAL_MOD has some strange cases we must handle.  In particular the */
 /* last fft word translated can be 2^bits and the next word could be -1, */
@@ -1070,29 +1668,31 @@ int gwserialize(
 
 	if (gwdata->GENERAL_MOD) {
 		long	val, prev_val;
-		while (limit < gwdata->FFTLEN) {
-			err_code = get_fft_value (gwdata, gg, limit, &val);
+		while (*limit < gwdata->FFTLEN) {
+			err_code = get_fft_value (gwdata, gg, *limit, &val);
 			if (err_code) return (err_code);
 			if (val == -1 || val == 0) break;
-			limit++;
-			ASSERTG (limit <= gwdata->FFTLEN / 2 + 2);
-			if (limit > gwdata->FFTLEN / 2 + 2) return (GWERROR_INTERNAL + 9);
+			(*limit)++;
+			ASSERTG (*limit <= gwdata->FFTLEN / 2 + 2);
+			if (*limit > gwdata->FFTLEN / 2 + 2) return (GWERROR_INTERNAL + 9);
 		}
-		while (limit > 1) {		/* Find top word */
-			err_code = get_fft_value (gwdata, gg, limit-1, &prev_val);
+		while (*limit > 1) {		/* Find top word */
+			err_code = get_fft_value (gwdata, gg, *limit-1, &prev_val);
 			if (err_code) return (err_code);
 			if (val != prev_val || val < -1 || val > 0) break;
-			limit--;
+			(*limit)--;
 		}
-		limit++;
+		(*limit)++;
 	}
 
-    if ((int)limit + GWSERIALIZE_HEADER_SIZE > arraylen)
-    {
-        *arrayused = -((int)limit + GWSERIALIZE_HEADER_SIZE);
-        return GWERROR_MALLOC;
-    }
+    return (0);
+}
 
+static void gwserialize_header(
+    gwhandle *gwdata,  /* Handle initialized by gwsetup */
+    unsigned long limit, /* Number of FFT words to serialize */
+    uint32_t *array)   /* Array to contain the header */
+{
     array[0] = 0;
     array[1] = 0;
     array[2] = 0;
@@ -1100,36 +1700,75 @@ int gwserialize(
     array[4] = 0;
     array[5] = 0;
 
+    uint8_t* header = (uint8_t*)array;
+    if (!gwdata->RATIONAL_FFT)
+        header[0] |= GWSERIALIZE_FLAG_IRRATIONAL;
+    if (gwdata->GENERAL_MOD)
+        header[0] |= GWSERIALIZE_FLAG_GENERALMOD;
+    if (gwdata->GENERAL_MMGW_MOD)
+        header[0] |= GWSERIALIZE_FLAG_MMGW_MOD;
+    header[1] = (uint8_t)gwdata->NUM_B_PER_SMALL_WORD;
+    array[1] = (uint32_t)gwdata->b;
+    array[2] = (uint32_t)gwdata->FFTLEN;
+    array[3] = (uint32_t)(gwdata->GENERAL_MMGW_MOD ? gwdata->n : limit);
+    *(uint64_t*)(array + 4) = (uint64_t)gwdata->k;
+}
+
+static int gwserialize_words(
+    gwhandle *gwdata,  /* Handle initialized by gwsetup */
+    gwiter *iter,      /* Iterator positioned on the first word */
+    uint32_t *array,   /* Array to contain the serialized words */
+    unsigned long count) /* Number of words to serialize */
+{
+    int	err_code;
     int32_t val;
     unsigned long i;
-    gwiter iter;
-    for (i = 0, gwiter_init_zero(gwdata, &iter, gg); i < limit; i++, gwiter_next(&iter))
+    for (i = 0; i < count; i++, gwiter_next(iter))
     {
         /*if (gwdata->GENERAL_MMGW_MOD && i == gwdata->FFTLEN)
             gwiter_init_zero(gwdata->negacyclic_gwdata, &iter, negacyclic_gwnum(gwdata, gg));*/
-        err_code = gwiter_get_fft_value(&iter, &val);
+        err_code = gwiter_get_fft_value(iter, &val);
         if (err_code) return (err_code);
         if (!gwdata->RATIONAL_FFT)
         {
             val <<= 1;
-            if (gwiter_is_big_word(&iter))
+            if (gwiter_is_big_word(iter))
                 val |= 1;
         }
-        array[i + GWSERIALIZE_HEADER_SIZE] = (uint32_t)val;
+        array[i] = (uint32_t)val;
     }
+    return (0);
+}
 
-    uint8_t* header = (uint8_t*)array;
-    if (!gwdata->RATIONAL_FFT)
-        header[0] |= GWSERIALIZE_FLAG_IRRATIONAL;
-    if (gwdata->GENERAL_MOD)
-        header[0] |= GWSERIALIZE_FLAG_GENERALMOD;
-    if (gwdata->GENERAL_MMGW_MOD)
-        header[0] |= GWSERIALIZE_FLAG_MMGW_MOD;
-    header[1] = (uint8_t)gwdata->NUM_B_PER_SMALL_WORD;
-    array[1] = (uint32_t)gwdata->b;
-    array[2] = (uint32_t)gwdata->FFTLEN;
-    array[3] = (uint32_t)(gwdata->GENERAL_MMGW_MOD ? gwdata->n : limit);
-    *(uint64_t*)(array + 4) = (uint64_t)gwdata->k;
+int gwserialize(
+    gwhandle *gwdata,  /* Handle initialized by gwsetup */
+    gwnum gg,          /* Source gwnum */
+    uint32_t *array,   /* Array to contain the serialized value */
+    int arraylen,	   /* Maximum size of the array */
+    int *arrayused)    /* Size of the serialized value */
+{
+    int	err_code;
+    unsigned long limit;
+    gwiter iter;
+
+/* Set result to zero in case of error.  If caller does not check the returned error code */
+/* a result value of zero is less likely to cause problems/crashes. */
+
+    *arrayused = 0;
+
+    err_code = gwserialize_limit(gwdata, gg, &limit);
+    if (err_code) return (err_code);
+
+    if ((int)limit + GWSERIALIZE_HEADER_SIZE > arraylen)
+    {
+        *arrayused = -((int)limit + GWSERIALIZE_HEADER_SIZE);
+        return GWERROR_MALLOC;
+    }
+
+    gwiter_init_zero(gwdata, &iter, gg);
+    err_code = gwserialize_words(gwdata, &iter, array + GWSERIALIZE_HEADER_SIZE, limit);
+    if (err_code) return (err_code);
+    gwserialize_header(gwdata, limit, array);
     *arrayused = (int)limit + GWSERIALIZE_HEADER_SIZE;
 
 /* Return success */
@@ -1138,6 +1777,57 @@ int gwserialize(
 	return (0);
 }
 
+int gwserialize_size(
+    gwhandle *gwdata,  /* Handle initialized by gwsetup */
+    gwnum gg,          /* Source gwnum */
+    int *size)         /* Size of the serialized value */
+{
+    int	err_code;
+    unsigned long limit;
+
+    *size = 0;
+    err_code = gwserialize_limit(gwdata, gg, &limit);
+    if (err_code) return (err_code);
+    *size = (int)limit + GWSERIALIZE_HEADER_SIZE;
+    return (0);
+}
+
+int gwserialize_blocks(
+    gwhandle *gwdata,  /* Handle initialized by gwsetup */
+    gwnum gg,          /* Source gwnum */
+    uint32_t *block,   /* Buffer for one block */
+    int blocklen,      /* Size of the buffer, at least the header size */
+    const std::function<void(const uint32_t *data, int count)>& output)
+{
+    int err_code;
+    unsigned long limit, i, count;
+    gwiter iter;
+
+    ASSERTG(blocklen >= GWSERIALIZE_HEADER_SIZE);
+    err_code = gwserialize_limit(gwdata, gg, &limit);
+    if (err_code) return (err_code);
+
+    gwserialize_header(gwdata, limit, block);
+    count = 0;
+    gwiter_init_zero(gwdata, &iter, gg);
+    for (i = 0; i < limit; i += count)
+    {
+        count = (unsigned long)blocklen - (i == 0 ? GWSERIALIZE_HEADER_SIZE : 0);
+        if (count > limit - i)
+            count = limit - i;
+        err_code = gwserialize_words(gwdata, &iter, block + (i == 0 ? GWSERIALIZE_HEADER_SIZE : 0), count);
+        if (err_code) return (err_code);
+        output(block, (int)count + (i == 0 ? GWSERIALIZE_HEADER_SIZE : 0));
+    }
+    if (limit == 0)
+    {
+        output(block, GWSERIALIZE_HEADER_SIZE);
+    }
+
+    gwdata->read_count += 1;
+    return (0);
+}
+
 void gwdeserialize(
     gwhandle *gwdata,	    /* Handle initialized by gwsetup */
     const uint32_t *array,  /* Array containing the binary value */
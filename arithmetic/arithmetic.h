@@ -3,13 +3,98 @@
 #include <memory>
 #include <vector>
 #include <unordered_set>
+#include <unordered_map>
 #include <mutex>
+#include <type_traits>
+#include <functional>
 
 #include "field.h"
 #include "giant.h"
+#include "exception.h"
 
 namespace arithmetic
 {
+    class GWNumPool
+    {
+    public:
+        GWNumPool(gwhandle* gwdata) : _gwdata(gwdata), _size(gwnum_size(gwdata)) { }
+        ~GWNumPool() { clear(); }
+
+        gwnum alloc();
+        void free(gwnum a);
+        // A buffer handed to an owner that frees it with gwfree, or taken over from one, leaves or enters the counts.
+        void release();
+        void adopt();
+        void reserve(int count);
+        void clear();
+
+        int max_free = 32;
+
+        size_t size() { return _size; }
+        int free_count() { return (int)_free.size(); }
+        int used_count() { return _used; }
+        uint64_t hits() { return _hits; }
+        uint64_t misses() { return _misses; }
+        size_t bytes() { return (_used + _free.size())*_size; }
+        size_t peak_bytes() { return _peak*_size; }
+        void reset_stats() { _hits = 0; _misses = 0; _peak = _used + _free.size(); }
+
+    private:
+        gwhandle* _gwdata;
+        size_t _size;
+        std::vector<gwnum> _free;
+        int _used = 0;
+        size_t _peak = 0;
+        uint64_t _hits = 0;
+        uint64_t _misses = 0;
+    };
+
+    class GWState;
+
+    // On-disk cache of FFT lengths chosen by gwsetup, with measured multiplication times.
+    // Entries are invalidated when the gwnum version or the CPU changes.
+    class GWSetupCache
+    {
+    public:
+        struct Entry
+        {
+            uint64_t k;
+            uint64_t b;
+            uint64_t n_bucket;
+            int64_t c;
+            int cpu_flags;
+            int thread_count;
+            double safety_margin;
+            int fft_length;
+            double ms_per_mul;
+        };
+
+    public:
+        GWSetupCache(const std::string& filename) : _filename(filename) { load(); }
+        ~GWSetupCache() { save(); }
+
+        bool load();
+        void save();
+        int find(GWState& state, uint64_t k, uint64_t b, uint64_t n, int64_t c);
+        void update(GWState& state, uint64_t k, uint64_t b, uint64_t n, int64_t c);
+        static double benchmark(GWState& state, int count);
+        static std::string signature();
+
+        int n_bucket_bits = 10;
+        int bench_count = 50;
+        int bench_neighbors = 1;
+        const std::vector<Entry>& entries() { return _entries; }
+
+    private:
+        bool match(const Entry& e, GWState& state, uint64_t k, uint64_t b, uint64_t n, int64_t c);
+
+    private:
+        std::string _filename;
+        std::vector<Entry> _entries;
+        bool _modified = false;
+        std::mutex _mutex;
+    };
+
     class GWState
     {
     public:
@@ -51,6 +136,7 @@ namespace arithmetic
         std::string instructions;
         bool information_only = false;
         Giant known_factors;
+        GWSetupCache* setup_cache = nullptr;
 
         void copy(const GWState& a)
         {
@@ -65,6 +151,7 @@ namespace arithmetic
             spin_threads = a.spin_threads;
             instructions = a.instructions;
             known_factors = a.known_factors;
+            setup_cache = a.setup_cache;
         }
 
         gwhandle handle;
@@ -75,12 +162,14 @@ namespace arithmetic
         int fft_length;
         int bit_length;
         std::unique_ptr<arithmetic::GWState> mod_gwstate;
+        std::unique_ptr<GWNumPool> pool;
         int32_t _addin = 0;
         int32_t _postaddin = 0;
     };
 
     class GWNum;
     class GWNumWrapper;
+    class GWExpr { };
     class CarefulGWArithmetic;
     class ReliableGWArithmetic;
 
@@ -105,6 +194,8 @@ namespace arithmetic
         virtual int cmp(const GWNum& a, const GWNum& b) override;
         virtual int cmp(const GWNum& a, int32_t b) override;
         virtual int cmp(const GWNum& a, const Giant& b);
+        virtual bool eq(const GWNum& a, const GWNum& b) override;
+        virtual bool eq(const GWNum& a, int32_t b) override;
         virtual void add(GWNum& a, GWNum& b, GWNum& res) override;
         virtual void add(GWNum& a, int32_t b, GWNum& res) override;
         virtual void add(GWNum& a, GWNum& b, GWNum& res, int options);
@@ -121,6 +212,10 @@ namespace arithmetic
         virtual void inv(GWNum& a, GWNum& n, GWNum& res) override;
         virtual void inv(GWNum& a, GWNum& res);
         virtual void mod(GWNum& a, GWNum& b, GWNum& res) override;
+        template <typename Iter, typename Func>
+        bool inv(Iter begin, Iter end, Func get, Giant& divisor, int options = 0);
+        template <typename Iter>
+        bool inv(Iter begin, Iter end, Giant& divisor, int options = 0);
 
         virtual void addsub(GWNum& a, GWNum& b, GWNum& res1, GWNum& res2, int options);
         virtual void addmul(GWNum& a, GWNum& b, GWNum& c, GWNum& res, int options);
@@ -146,9 +241,25 @@ namespace arithmetic
         int32_t mulbyconst() { return gwdata()->mulbyconst; }
         int32_t addin() { return _state._addin; }
 
+        // Auto-flag mode infers FFT_S*, STARTNEXTFFT and add normalization flags from the state of the operands.
+        // expect(a, count) declares that the next value of a will be a multiplication source count times.
+        void set_auto_flags(bool value);
+        bool auto_flags() { return _auto_flags; }
+        void expect(GWNum& a, int count);
+        uint64_t avoided_ffts() { return _avoided_ffts; }
+
+    protected:
+        int eq_words(const GWNum& a, const GWNum* b, int32_t c);
+        int auto_mul_options(int options, GWNum& res, GWNum* s1, GWNum* s2, GWNum* s3 = nullptr, GWNum* s4 = nullptr);
+        int auto_add_options(int options, GWNum& a, GWNum& b);
+
     protected:
         GWState& _state;
         CarefulGWArithmetic* _careful = nullptr;
+        bool _auto_flags = false;
+        std::unordered_map<gwnum, int> _consumers;
+        std::unordered_set<gwnum> _auto_ffted;
+        uint64_t _avoided_ffts = 0;
     };
 
     class CarefulGWArithmetic : public GWArithmetic
@@ -174,6 +285,33 @@ namespace arithmetic
         virtual void mulmulsub(GWNum& a, GWNum& b, GWNum& c, GWNum& d, GWNum& res, int options) override;
     };
 
+    // Sorted operation numbers. The cursor follows the increasing operation counter, so lookups are O(1) amortized.
+    class SuspectOps
+    {
+    public:
+        bool check(int op)
+        {
+            if (_cursor > 0 && _ops[_cursor - 1] >= op)
+                seek(op);
+            while (_cursor < _ops.size() && _ops[_cursor] < op)
+                _cursor++;
+            return _cursor < _ops.size() && _ops[_cursor] == op;
+        }
+        void seek(int op);
+        void insert(int op);
+        void erase(int op);
+        void clear() { _ops.clear(); _cursor = 0; }
+
+        size_t size() const { return _ops.size(); }
+        bool empty() const { return _ops.empty(); }
+        std::vector<int>::const_iterator begin() const { return _ops.begin(); }
+        std::vector<int>::const_iterator end() const { return _ops.end(); }
+
+    private:
+        std::vector<int> _ops;
+        size_t _cursor = 0;
+    };
+
     class ReliableGWArithmetic : public GWArithmetic
     {
     public:
@@ -194,14 +332,37 @@ namespace arithmetic
         int op() { return _op; }
         bool restart_flag() { return _restart_flag; }
         bool failure_flag() { return _failure_flag; }
-        const std::unordered_set<int>& suspect_ops() { return _suspect_ops; }
+        const SuspectOps& suspect_ops() { return _suspect_ops; }
+
+        // Sampled mode checks roundoff on every check_period-th operation only.
+        // The period doubles while roundoff stays low and drops to 1 when it approaches the limit.
+        void set_sampling(bool value, int max_check_period = 64);
+        bool sampling() { return _sampling; }
+        int check_period() { return _check_period; }
+
+    private:
+        bool sample()
+        {
+            if (!_sampling)
+                return true;
+            if (--_check_countdown > 0)
+                return false;
+            gw_clear_maxerr(gwdata());
+            return true;
+        }
+        void adapt_sampling();
 
     private:
         int _op = 0;
-        std::unordered_set<int> _suspect_ops;
+        SuspectOps _suspect_ops;
         bool _restart_flag = false;
         bool _failure_flag = false;
         double _max_roundoff = 0.4;
+        bool _sampling = false;
+        int _max_check_period = 64;
+        int _check_period = 1;
+        int _check_countdown = 1;
+        int _low_checks = 0;
     };
 
     class SerializedGWNum
@@ -213,6 +374,11 @@ namespace arithmetic
         SerializedGWNum& operator = (const GWNum& a);
         void to_GWNum(GWNum& a) const;
 
+        // Stream the same format without holding the whole value in memory.
+        static size_t size(const GWNum& a);
+        static void serialize(const GWNum& a, std::function<void(const uint32_t* data, size_t size)> output, size_t block_size = 65536);
+        static void deserialize(const uint32_t* data, size_t size, GWNum& a);
+
     public:
         bool empty() const { return _data.empty(); }
         const uint32_t* data() const { return _data.data(); }
@@ -251,6 +417,12 @@ namespace arithmetic
         {
             arithmetic().move(std::move(a), *this);
         }
+        template<class Expr, std::enable_if_t<std::is_base_of_v<GWExpr, Expr>, int> = 0>
+        GWNum(const Expr& a) : FieldElement<GWArithmetic, GWNum>(a.arithmetic())
+        {
+            arithmetic().alloc(*this);
+            a.eval(*this);
+        }
 
         virtual GWNum& operator = (const GWNum& a)
         {
@@ -263,6 +435,12 @@ namespace arithmetic
             return *this;
         }
         using FieldElement<GWArithmetic, GWNum>::operator=;
+        template<class Expr, std::enable_if_t<std::is_base_of_v<GWExpr, Expr>, int> = 0>
+        GWNum& operator = (const Expr& a)
+        {
+            a.eval(*this);
+            return *this;
+        }
 
         virtual std::string to_string() const override;
         GWNum& operator = (const Giant& a)
@@ -352,6 +530,187 @@ namespace arithmetic
         GWNum& operator = (GWNum&& a) noexcept override { *this = a; return *this; }
         //operator GWNum&&() = delete; // No effect, just a remainder
     };
+
+    inline GWNum* gwnum_ptr(GWNum& a) { return &a; }
+    inline GWNum* gwnum_ptr(GWNum* a) { return a; }
+    inline GWNum* gwnum_ptr(std::unique_ptr<GWNum>& a) { return a.get(); }
+
+    // Montgomery's simultaneous inversion, one Giant inversion and 3(n-1) multiplications.
+    // get(*it) returns the element to invert or nullptr to skip it. If some element is not invertible,
+    // the elements are left unchanged, divisor is set to the common factor with N and false is returned.
+    template <typename Iter, typename Func>
+    bool GWArithmetic::inv(Iter begin, Iter end, Func get, Giant& divisor, int options)
+    {
+        std::vector<GWNum*> elements;
+        for (Iter it = begin; it != end; it++)
+        {
+            GWNum* a = get(*it);
+            if (a != nullptr)
+                elements.push_back(a);
+        }
+        if (elements.empty())
+            return true;
+        size_t n = elements.size();
+
+        std::vector<GWNum> prefix;
+        prefix.reserve(n - 1);
+        GWNum* prev = elements[0];
+        for (size_t i = 1; i < n; i++)
+        {
+            prefix.emplace_back(*this);
+            mul(*prev, *elements[i], prefix.back(), GWMUL_FFT_S1 | GWMUL_FFT_S2 | (i + 1 < n ? GWMUL_STARTNEXTFFT : 0));
+            prev = &prefix.back();
+        }
+
+        GWNum inverse(*this);
+        try
+        {
+            (popg() = *prev).inv(N()).to_GWNum(inverse);
+        }
+        catch (const NoInverseException& e)
+        {
+            divisor = e.divisor;
+            return false;
+        }
+
+        for (size_t i = n - 1; i > 0; i--)
+        {
+            GWNum& t = prefix[i - 1];
+            mul(inverse, i > 1 ? prefix[i - 2] : *elements[0], t, GWMUL_FFT_S1 | GWMUL_FFT_S2 | options);
+            mul(inverse, *elements[i], inverse, GWMUL_FFT_S2 | (i > 1 ? GWMUL_STARTNEXTFFT : options));
+            *elements[i] = std::move(t);
+        }
+        *elements[0] = std::move(inverse);
+        return true;
+    }
+
+    template <typename Iter>
+    bool GWArithmetic::inv(Iter begin, Iter end, Giant& divisor, int options)
+    {
+        return inv(begin, end, [](auto& a) { return gwnum_ptr(a); }, divisor, options);
+    }
+
+    // Expression templates. fused(a)*b + c is evaluated by a single muladd on assignment to GWNum.
+    // Recognized shapes: a*b, a +- b, a*b +- c, (a +- b)*c, a*b +- c*d.
+
+    class GWTermExpr : public GWExpr
+    {
+    public:
+        GWTermExpr(GWNum& a) : a(a) { }
+        GWArithmetic& arithmetic() const { return a.arithmetic(); }
+        void eval(GWNum& res) const { res = a; }
+
+        GWNum& a;
+    };
+
+    inline GWTermExpr fused(GWNum& a) { return GWTermExpr(a); }
+
+    class GWMulExpr : public GWExpr
+    {
+    public:
+        GWMulExpr(GWNum& a, GWNum& b) : a(a), b(b) { }
+        GWArithmetic& arithmetic() const { return a.arithmetic(); }
+        GWMulExpr& options(int value) { _options = value; return *this; }
+        void eval(GWNum& res) const { arithmetic().mul(a, b, res, _options); }
+
+        GWNum& a;
+        GWNum& b;
+        int _options = GWMUL_FFT_S1 | GWMUL_FFT_S2 | GWMUL_STARTNEXTFFT;
+    };
+
+    template<bool Sub>
+    class GWAddExpr : public GWExpr
+    {
+    public:
+        GWAddExpr(GWNum& a, GWNum& b) : a(a), b(b) { }
+        GWArithmetic& arithmetic() const { return a.arithmetic(); }
+        GWAddExpr& options(int value) { _options = value; return *this; }
+        void eval(GWNum& res) const { if (Sub) arithmetic().sub(a, b, res, _options); else arithmetic().add(a, b, res, _options); }
+
+        GWNum& a;
+        GWNum& b;
+        int _options = GWADD_DELAY_NORMALIZE;
+    };
+
+    template<bool Sub>
+    class GWMulAddExpr : public GWExpr
+    {
+    public:
+        GWMulAddExpr(const GWMulExpr& ab, GWNum& c) : a(ab.a), b(ab.b), c(c), _options(ab._options | GWMUL_FFT_S3) { }
+        GWArithmetic& arithmetic() const { return a.arithmetic(); }
+        GWMulAddExpr& options(int value) { _options = value; return *this; }
+        void eval(GWNum& res) const { if (Sub) arithmetic().mulsub(a, b, c, res, _options); else arithmetic().muladd(a, b, c, res, _options); }
+
+        GWNum& a;
+        GWNum& b;
+        GWNum& c;
+        int _options;
+    };
+
+    template<bool Sub>
+    class GWAddMulExpr : public GWExpr
+    {
+    public:
+        GWAddMulExpr(const GWAddExpr<Sub>& ab, GWNum& c) : a(ab.a), b(ab.b), c(c) { }
+        GWArithmetic& arithmetic() const { return a.arithmetic(); }
+        GWAddMulExpr& options(int value) { _options = value; return *this; }
+        void eval(GWNum& res) const { if (Sub) arithmetic().submul(a, b, c, res, _options); else arithmetic().addmul(a, b, c, res, _options); }
+
+        GWNum& a;
+        GWNum& b;
+        GWNum& c;
+        int _options = GWMUL_FFT_S1 | GWMUL_FFT_S2 | GWMUL_FFT_S3 | GWMUL_STARTNEXTFFT;
+    };
+
+    template<bool Sub>
+    class GWMulMulAddExpr : public GWExpr
+    {
+    public:
+        // Source flags of ab stay on S1 and S2, those of cd move to S3 and S4. Other flags are kept only if both products have them.
+        GWMulMulAddExpr(const GWMulExpr& ab, const GWMulExpr& cd) : a(ab.a), b(ab.b), c(cd.a), d(cd.b),
+            _options((ab._options & SOURCE_S12) | ((cd._options & SOURCE_S12) << 4) | (ab._options & cd._options & ~(SOURCE_S12 | (SOURCE_S12 << 4)))) { }
+        GWArithmetic& arithmetic() const { return a.arithmetic(); }
+        GWMulMulAddExpr& options(int value) { _options = value; return *this; }
+        void eval(GWNum& res) const { if (Sub) arithmetic().mulmulsub(a, b, c, d, res, _options); else arithmetic().mulmuladd(a, b, c, d, res, _options); }
+
+        GWNum& a;
+        GWNum& b;
+        GWNum& c;
+        GWNum& d;
+        int _options;
+
+        static const int SOURCE_S12 = GWMUL_FFT_S1 | GWMUL_PRESERVE_S1 | GWMUL_FFT_S2 | GWMUL_PRESERVE_S2;
+        static_assert((SOURCE_S12 << 4) == (GWMUL_FFT_S3 | GWMUL_PRESERVE_S3 | GWMUL_FFT_S4 | GWMUL_PRESERVE_S4), "S3, S4 flags follow S1, S2");
+    };
+
+    inline GWMulExpr operator * (const GWTermExpr& a, GWNum& b) { return GWMulExpr(a.a, b); }
+    inline GWMulExpr operator * (GWNum& a, const GWTermExpr& b) { return GWMulExpr(a, b.a); }
+    inline GWMulExpr operator * (const GWTermExpr& a, const GWTermExpr& b) { return GWMulExpr(a.a, b.a); }
+    inline GWAddExpr<false> operator + (const GWTermExpr& a, GWNum& b) { return GWAddExpr<false>(a.a, b); }
+    inline GWAddExpr<false> operator + (GWNum& a, const GWTermExpr& b) { return GWAddExpr<false>(a, b.a); }
+    inline GWAddExpr<false> operator + (const GWTermExpr& a, const GWTermExpr& b) { return GWAddExpr<false>(a.a, b.a); }
+    inline GWAddExpr<true> operator - (const GWTermExpr& a, GWNum& b) { return GWAddExpr<true>(a.a, b); }
+    inline GWAddExpr<true> operator - (GWNum& a, const GWTermExpr& b) { return GWAddExpr<true>(a, b.a); }
+    inline GWAddExpr<true> operator - (const GWTermExpr& a, const GWTermExpr& b) { return GWAddExpr<true>(a.a, b.a); }
+
+    inline GWMulAddExpr<false> operator + (const GWMulExpr& ab, GWNum& c) { return GWMulAddExpr<false>(ab, c); }
+    inline GWMulAddExpr<false> operator + (GWNum& c, const GWMulExpr& ab) { return GWMulAddExpr<false>(ab, c); }
+    inline GWMulAddExpr<false> operator + (const GWMulExpr& ab, const GWTermExpr& c) { return GWMulAddExpr<false>(ab, c.a); }
+    inline GWMulAddExpr<false> operator + (const GWTermExpr& c, const GWMulExpr& ab) { return GWMulAddExpr<false>(ab, c.a); }
+    inline GWMulAddExpr<true> operator - (const GWMulExpr& ab, GWNum& c) { return GWMulAddExpr<true>(ab, c); }
+    inline GWMulAddExpr<true> operator - (const GWMulExpr& ab, const GWTermExpr& c) { return GWMulAddExpr<true>(ab, c.a); }
+
+    template<bool Sub>
+    GWAddMulExpr<Sub> operator * (const GWAddExpr<Sub>& ab, GWNum& c) { return GWAddMulExpr<Sub>(ab, c); }
+    template<bool Sub>
+    GWAddMulExpr<Sub> operator * (GWNum& c, const GWAddExpr<Sub>& ab) { return GWAddMulExpr<Sub>(ab, c); }
+    template<bool Sub>
+    GWAddMulExpr<Sub> operator * (const GWAddExpr<Sub>& ab, const GWTermExpr& c) { return GWAddMulExpr<Sub>(ab, c.a); }
+    template<bool Sub>
+    GWAddMulExpr<Sub> operator * (const GWTermExpr& c, const GWAddExpr<Sub>& ab) { return GWAddMulExpr<Sub>(ab, c.a); }
+
+    inline GWMulMulAddExpr<false> operator + (const GWMulExpr& ab, const GWMulExpr& cd) { return GWMulMulAddExpr<false>(ab, cd); }
+    inline GWMulMulAddExpr<true> operator - (const GWMulExpr& ab, const GWMulExpr& cd) { return GWMulMulAddExpr<true>(ab, cd); }
 }
 
 int gwconvert(
@@ -360,6 +719,14 @@ int gwconvert(
     gwnum	s,
     gwnum	d);
 
+int gwconvert_batch(
+    gwhandle *gwdata_s,	/* Handle initialized by gwsetup */
+    gwhandle *gwdata_d,	/* Handle initialized by gwsetup */
+    gwnum	*s,         /* Array of source gwnums */
+    gwnum	*d,         /* Array of destination gwnums */
+    int count,          /* Number of gwnums to convert */
+    int threads);       /* Number of threads to use */
+
 int gwserialize(
     gwhandle *gwdata,   /* Handle initialized by gwsetup */
     gwnum s,            /* Source gwnum */
@@ -367,6 +734,18 @@ int gwserialize(
     int arraylen,	    /* Maximum size of the array */
     int *arrayused);    /* Size of the serialized value */
 
+int gwserialize_size(
+    gwhandle *gwdata,   /* Handle initialized by gwsetup */
+    gwnum s,            /* Source gwnum */
+    int *size);         /* Size of the serialized value */
+
+int gwserialize_blocks(
+    gwhandle *gwdata,   /* Handle initialized by gwsetup */
+    gwnum s,            /* Source gwnum */
+    uint32_t *block,    /* Buffer for one block */
+    int blocklen,       /* Size of the buffer, at least the header size */
+    const std::function<void(const uint32_t *data, int count)>& output);
+
 void gwdeserialize(
     gwhandle *gwdata,	    /* Handle initialized by gwsetup */
     const uint32_t *array,  /* Array containing the binary value */
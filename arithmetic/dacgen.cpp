@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+
+#include "gwnum.h"
+#include "group.h"
+
+using namespace arithmetic;
+
+// Builds the DAC chain database for all primes up to a bound: dacgen <max_prime> <file> [threads]
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        printf("Usage: dacgen <max_prime> <file> [threads]\n");
+        return 1;
+    }
+    int max_prime = atoi(argv[1]);
+    int threads = argc > 3 ? atoi(argv[3]) : (int)std::thread::hardware_concurrency();
+
+    DACDatabase database;
+    if (!database.generate(max_prime, threads))
+    {
+        printf("DAC search failed.\n");
+        return 1;
+    }
+    if (!database.save(argv[2]))
+    {
+        printf("Can't write %s.\n", argv[2]);
+        return 1;
+    }
+    printf("%d primes up to %d.\n", (int)database.size(), max_prime);
+    return 0;
+}
@@ -1,5 +1,7 @@
 
 #include <stdlib.h>
+#include <thread>
+#include <exception>
 #include <immintrin.h>
 #include "cpuid.h"
 #include "gwnum.h"
@@ -116,6 +118,32 @@ namespace arithmetic
         return gw().cmp(tmp, tmp2);
     }
 
+    bool EdwardsArithmetic::eq(const EdPoint& a, const EdPoint& b)
+    {
+        GWNum tmp(gw());
+        GWNum tmp2(gw());
+        // Products are left unFFTed so that GWArithmetic::eq can compare FFT words.
+        auto cross = [&](const std::unique_ptr<GWNum>& x, const std::unique_ptr<GWNum>& z, GWNum& res)
+        {
+            if (x && z)
+                gw().mul(*x, *z, res, GWMUL_FFT_S1 | GWMUL_FFT_S2);
+            else if (x)
+                res = *x;
+            else if (z)
+                res = *z;
+            else
+                res = 1;
+        };
+
+        cross(a.X, b.Z, tmp);
+        cross(b.X, a.Z, tmp2);
+        if (!gw().eq(tmp, tmp2))
+            return false;
+        cross(a.Y, b.Z, tmp);
+        cross(b.Y, a.Z, tmp2);
+        return gw().eq(tmp, tmp2);
+    }
+
     void EdwardsArithmetic::add(EdPoint& a, EdPoint& b, EdPoint& res)
     {
         add(a, b, res, GWMUL_STARTNEXTFFT);
@@ -279,49 +307,101 @@ namespace arithmetic
             _tmp.reset(res.T.release());
     }
 
-    void EdwardsArithmetic::mul(EdPoint& a, Giant& b, EdPoint& res)
+    int EdwardsArithmetic::mul_W(int len)
     {
-        int len = b.bitlen();
         int W;
         for (W = 2; W < 16 && /*3 + 3*(1 << (W - 1)) <= maxSize &&*/ (14 << (W - 2)) + len/0.69*(7 + 7/(W + 1.0)) > (14 << (W - 1)) + len/0.69*(7 + 7/(W + 2.0)); W++);
+        return W;
+    }
+
+    void EdwardsArithmetic::mul(EdPoint& a, Giant& b, EdPoint& res)
+    {
+        int W = mul_W(b.bitlen());
         std::vector<int16_t> naf_w;
         get_NAF_W(W, b, naf_w);
         mul(a, W, naf_w, res);
     }
 
-    void EdwardsArithmetic::mul(EdPoint& a, int W, std::vector<int16_t>& naf_w, EdPoint& res)
+    void EdwardsArithmetic::mul_dictionary(EdPoint& a, int W, std::vector<std::unique_ptr<EdPoint>>& u, EdPoint& tmp)
     {
-        int i, j;
-
-        std::vector<std::unique_ptr<EdPoint>> u;
+        int i;
+        u.clear();
         for (i = 0; i < (1 << (W - 2)); i++)
             u.emplace_back(new EdPoint(*this));
-
-        // Dictionary
         copy(a, *u[0]);
         if (W > 2)
         {
-            dbl(a, res, GWMUL_STARTNEXTFFT);
+            dbl(a, tmp, GWMUL_STARTNEXTFFT);
             for (i = 1; i < (1 << (W - 2)); i++)
-                add(*u[i - 1], res, *u[i], GWMUL_STARTNEXTFFT);
+                add(*u[i - 1], tmp, *u[i], GWMUL_STARTNEXTFFT);
         }
+    }
+
+    void EdwardsArithmetic::mul_step(EdPoint& res, int W, int digit, std::vector<std::unique_ptr<EdPoint>>& u, bool last)
+    {
+        if (digit != 0)
+        {
+            for (int j = 1; j < W; j++)
+                dbl(res, res, GWMUL_STARTNEXTFFT | ED_PROJECTIVE);
+            dbl(res, res, GWMUL_STARTNEXTFFT | (!last ? 0 : EDDBL_FOR_EXT_NORM_ADD));
+            add(res, *u[abs(digit)/2], res, (!last ? GWMUL_STARTNEXTFFT | ED_PROJECTIVE : 0) | (digit < 0 ? EDADD_NEGATIVE : 0));
+        }
+        else
+            dbl(res, res, (!last ? GWMUL_STARTNEXTFFT | ED_PROJECTIVE : 0));
+    }
+
+    void EdwardsArithmetic::mul(EdPoint& a, int W, std::vector<int16_t>& naf_w, EdPoint& res)
+    {
+        int i;
+
+        // Dictionary
+        std::vector<std::unique_ptr<EdPoint>> u;
+        mul_dictionary(a, W, u, res);
         if (naf_w.size() > 100)
             normalize(u.begin(), u.end(), 0);
 
         // Signed window
         copy(*u[naf_w.back()/2], res);
         for (i = (int)naf_w.size() - 2; i >= 0; i--)
+            mul_step(res, W, naf_w[i], u, i == 0);
+        _tmp.reset();
+    }
+
+    void EdwardsArithmetic::mul(EdPoint& a, std::vector<int8_t>& jsf_a, EdPoint& b, std::vector<int8_t>& jsf_b, EdPoint& res)
+    {
+        int i;
+
+        if (jsf_a.empty())
         {
-            if (naf_w[i] != 0)
-            {
-                for (j = 1; j < W; j++)
-                    dbl(res, res, GWMUL_STARTNEXTFFT | ED_PROJECTIVE);
-                dbl(res, res, GWMUL_STARTNEXTFFT | (i > 0 ? 0 : EDDBL_FOR_EXT_NORM_ADD));
-                add(res, *u[abs(naf_w[i])/2], res, (i > 0 ? GWMUL_STARTNEXTFFT | ED_PROJECTIVE : 0) | (naf_w[i] < 0 ? EDADD_NEGATIVE : 0));
-            }
-            else
-                dbl(res, res, (i > 0 ? GWMUL_STARTNEXTFFT | ED_PROJECTIVE : 0));
+            init(res);
+            return;
         }
+
+        // Dictionary: a, b, a + b, a - b
+        std::vector<std::unique_ptr<EdPoint>> u;
+        for (i = 0; i < 4; i++)
+            u.emplace_back(new EdPoint(*this));
+        copy(a, *u[0]);
+        copy(b, *u[1]);
+        add(*u[0], *u[1], *u[2], GWMUL_STARTNEXTFFT);
+        add(*u[0], *u[1], *u[3], GWMUL_STARTNEXTFFT | EDADD_NEGATIVE);
+        if (jsf_a.size() > 100)
+            normalize(u.begin(), u.end(), 0);
+        // Signed odd digit with abs(digit)/2 indexing the dictionary, as in mul_step() with W = 1.
+        auto digit = [&](int8_t da, int8_t db) -> int
+        {
+            int d = da == 0 ? 3 : db == 0 ? 1 : da == db ? 5 : 7;
+            return da < 0 || (da == 0 && db < 0) ? -d : d;
+        };
+
+        // Joint signed binary, the top digit pair is nonzero. Doublings stay projective unless an addition follows.
+        i = (int)jsf_a.size() - 1;
+        if (digit(jsf_a[i], jsf_b[i]) < 0)
+            neg(*u[-digit(jsf_a[i], jsf_b[i])/2], res);
+        else
+            copy(*u[digit(jsf_a[i], jsf_b[i])/2], res);
+        for (i--; i >= 0; i--)
+            mul_step(res, 1, jsf_a[i] == 0 && jsf_b[i] == 0 ? 0 : digit(jsf_a[i], jsf_b[i]), u, i == 0);
         _tmp.reset();
     }
 
@@ -335,67 +415,298 @@ namespace arithmetic
     template <typename Iter>
     void EdwardsArithmetic::normalize(Iter begin, Iter end, int options)
     {
-        Iter it;
-        Iter first = end;
-        Iter last = end;
-        for (it = begin; it != end; it++)
+        Giant divisor = gw().popg();
+        if (!gw().inv(begin, end, [](auto& a) { return a && a->Z ? a->Z.get() : nullptr; }, divisor, GWMUL_STARTNEXTFFT))
+            throw NoInverseException(divisor);
+        for (Iter it = begin; it != end; it++)
         {
             if (!(*it))
                 continue;
-            if (first == end)
-                first = it;
-            last = it;
-            if (!(*it)->Z)
+            if ((*it)->Z)
             {
-                (*it)->Z.reset(new GWNum(gw()));
-                *(*it)->Z = 1;
+                if ((*it)->X)
+                    gw().mul(*(*it)->Z, *(*it)->X, *(*it)->X, options);
+                if ((*it)->Y)
+                    gw().mul(*(*it)->Z, *(*it)->Y, *(*it)->Y, options);
+                (*it)->Z.reset();
+            }
+            if ((*it)->X && (*it)->Y && !(options & ED_PROJECTIVE))
+            {
+                if (!(*it)->T)
+                    (*it)->T.reset(new GWNum(gw()));
+                gw().mul(*(*it)->X, *(*it)->Y, *(*it)->T, GWMUL_FFT_S1 | GWMUL_FFT_S2 | options);
             }
-            if (!(*it)->T)
-                (*it)->T.reset(new GWNum(gw()));
+            else
+                (*it)->T.reset();
+        }
+    }
+
+    template void EdwardsArithmetic::normalize(std::vector<std::unique_ptr<EdPoint>>::iterator begin, std::vector<std::unique_ptr<EdPoint>>::iterator end, int options);
+    template void EdwardsArithmetic::normalize(std::vector<EdPoint*>::iterator begin, std::vector<EdPoint*>::iterator end, int options);
+
+    void EdComb::init(int teeth, int columns, bool fft)
+    {
+        _teeth = teeth;
+        _columns = columns;
+        _fft = fft;
+        _table.clear();
+        for (int i = 0; i < (1 << teeth) - 1; i++)
+        {
+            _table.emplace_back(new EdPoint(_arithmetic));
+            _table.back()->X.reset(new GWNum(_arithmetic.gw()));
+            _table.back()->Y.reset(new GWNum(_arithmetic.gw()));
+            _table.back()->T.reset(new GWNum(_arithmetic.gw()));
+        }
+    }
+
+    void EdComb::init(EdPoint& a, int bits, int teeth, bool fft)
+    {
+        int i, j;
+        GWASSERT(teeth > 0 && teeth < 16);
+        init(teeth, (bits + teeth - 1)/teeth, false);
+
+        // Teeth 2^(i*columns)*P, then all their subset sums.
+        _arithmetic.copy(a, *_table[0]);
+        _table[0]->extend();
+        for (i = 1; i < teeth; i++)
+        {
+            EdPoint& tooth = *_table[(1 << i) - 1];
+            _arithmetic.dbl(*_table[(1 << (i - 1)) - 1], tooth, GWMUL_STARTNEXTFFT);
+            for (j = 1; j < _columns; j++)
+                _arithmetic.dbl(tooth, tooth, GWMUL_STARTNEXTFFT);
         }
-        if (first == end)
+        for (j = 3; j < (1 << teeth); j++)
+            if ((j & (j - 1)) != 0)
+                _arithmetic.add(*_table[(j & (j - 1)) - 1], *_table[(j & -j) - 1], *_table[j - 1], GWMUL_STARTNEXTFFT);
+        _arithmetic.normalize(_table.begin(), _table.end(), 0);
+
+        _fft = fft;
+        if (fft)
+            for (auto& p : _table)
+            {
+                _arithmetic.gw().fft(*p->X, *p->X);
+                _arithmetic.gw().fft(*p->Y, *p->Y);
+                _arithmetic.gw().fft(*p->T, *p->T);
+            }
+    }
+
+    void EdComb::mul(Giant& b, EdPoint& res)
+    {
+        int i, c;
+        if (b.bitlen() > bits())
+        {
+            // Too long for the table, signed window from the base point.
+            EdPoint P(_arithmetic);
+            _arithmetic.copy(*_table[0], P);
+            if (_fft)
+            {
+                _arithmetic.gw().unfft(*P.X, *P.X);
+                _arithmetic.gw().unfft(*P.Y, *P.Y);
+                _arithmetic.gw().unfft(*P.T, *P.T);
+            }
+            Giant e(b);
+            if (e < 0)
+                e.arithmetic().neg(e, e);
+            _arithmetic.mul(P, e, res);
+            if (b < 0)
+                _arithmetic.neg(res, res);
             return;
-        std::swap((*first)->T, (*first)->Z);
-        Iter prev = first;
-        for ((it = first)++; it != end; it++)
-            if (*it)
+        }
+        bool first = true;
+        for (c = _columns - 1; c >= 0; c--)
+        {
+            int index = 0;
+            for (i = _teeth - 1; i >= 0; i--)
+                index = 2*index + (b.bit(i*_columns + c) ? 1 : 0);
+            if (first)
             {
-                gw().mul(*(*prev)->T, *(*it)->Z, *(*it)->T, it != last ? GWMUL_STARTNEXTFFT : 0);
-                prev = it;
+                if (index == 0)
+                    continue;
+                _arithmetic.copy(*_table[index - 1], res);
+                first = false;
+                continue;
             }
-        try
+            if (index == 0)
+                _arithmetic.dbl(res, res, c > 0 ? GWMUL_STARTNEXTFFT | EdwardsArithmetic::ED_PROJECTIVE : 0);
+            else
+            {
+                _arithmetic.dbl(res, res, GWMUL_STARTNEXTFFT | (c > 0 ? 0 : EdwardsArithmetic::EDDBL_FOR_EXT_NORM_ADD));
+                _arithmetic.add(res, *_table[index - 1], res, c > 0 ? GWMUL_STARTNEXTFFT | EdwardsArithmetic::ED_PROJECTIVE : 0);
+            }
+        }
+        if (first)
         {
-            gw().inv(*(*last)->T, *(*last)->T);
+            _arithmetic.init(res);
+            return;
         }
-        catch (const ArithmeticException&)
+        if (_fft && !res.Z)
         {
-            std::swap((*first)->T, (*first)->Z);
-            throw;
+            // The result is a table entry as is.
+            _arithmetic.gw().unfft(*res.X, *res.X);
+            _arithmetic.gw().unfft(*res.Y, *res.Y);
+            _arithmetic.gw().unfft(*res.T, *res.T);
         }
-        for ((it = last)++, prev = last; it != first;)
+        if (b < 0)
+            _arithmetic.neg(res, res);
+    }
+
+    void EdECMStage1::run(Giant& exp, int seed)
+    {
+        int i;
+        _residues.clear();
+        _factors.clear();
+        if (_curves == 0)
+            return;
+        int W = EdwardsArithmetic::mul_W(exp.bitlen());
+        std::vector<int16_t> naf_w;
+        get_NAF_W(W, exp, naf_w);
+
+        for (i = 0; i < _curves; i++)
+            _residues.emplace_back();
+
+        // The calling thread takes the first group. With several groups each one runs on a single-threaded clone of the state.
+        std::vector<std::unique_ptr<GWState>> states;
+        std::vector<std::thread> helpers;
+        std::vector<std::exception_ptr> errors(_threads);
+        for (i = 0; i < _threads && _threads > 1; i++)
+        {
+            states.emplace_back(new GWState(_gwstate));
+            states.back()->thread_count = 1;
+            gwset_num_threads(states.back()->gwdata(), 1);
+        }
+        int first = 0;
+        for (i = 0; i < _threads; i++)
         {
-            it = prev;
-            if (it != first)
+            int count = _curves/_threads + (i < _curves%_threads ? 1 : 0);
+            if (i > 0)
             {
-                for ((prev = it)--; !(*prev); prev--);
-                gw().mul(*(*it)->T, *(*prev)->T, *(*prev)->T, GWMUL_STARTNEXTFFT);
-                std::swap((*it)->T, (*prev)->T);
-                gw().mul(*(*it)->Z, *(*prev)->T, *(*prev)->T, GWMUL_STARTNEXTFFT);
+                GWState* state = states[i].get();
+                helpers.emplace_back([this, state, first, count, W, &naf_w, seed, &errors, i]()
+                    {
+                        try
+                        {
+                            run_group(*state, first, count, W, naf_w, seed);
+                        }
+                        catch (...)
+                        {
+                            errors[i] = std::current_exception();
+                        }
+                    });
             }
-            if ((*it)->X)
-                gw().mul(*(*it)->T, *(*it)->X, *(*it)->X, options);
-            if ((*it)->Y)
-                gw().mul(*(*it)->T, *(*it)->Y, *(*it)->Y, options);
-            (*it)->Z.reset();
-            if ((*it)->X && (*it)->Y && !(options & ED_PROJECTIVE))
-                gw().mul(*(*it)->X, *(*it)->Y, *(*it)->T, GWMUL_FFT_S1 | GWMUL_FFT_S2 | options);
-            else
-                (*it)->T.reset();
+            first += count;
+        }
+        try
+        {
+            run_group(_threads > 1 ? *states[0] : _gwstate, 0, _curves/_threads + (0 < _curves%_threads ? 1 : 0), W, naf_w, seed);
+        }
+        catch (...)
+        {
+            errors[0] = std::current_exception();
+        }
+        for (auto& helper : helpers)
+            helper.join();
+        for (auto& error : errors)
+            if (error)
+                std::rethrow_exception(error);
+
+        // One gcd for all curves, split only if it finds something.
+        BatchGCD batch(GiantsArithmetic::default_arithmetic(), *_gwstate.N);
+        for (auto& residue : _residues)
+            batch.add(residue);
+        Giant divisor;
+        if (batch.gcd(divisor))
+            batch.split(_factors);
+        else
+        {
+            for (i = 0; i < _curves; i++)
+                _factors.emplace_back() = 1;
         }
     }
 
-    template void EdwardsArithmetic::normalize(std::vector<std::unique_ptr<EdPoint>>::iterator begin, std::vector<std::unique_ptr<EdPoint>>::iterator end, int options);
-    template void EdwardsArithmetic::normalize(std::vector<EdPoint*>::iterator begin, std::vector<EdPoint*>::iterator end, int options);
+    bool EdECMStage1::found(Giant& res)
+    {
+        bool ret = false;
+        res = 1;
+        for (auto& factor : _factors)
+            if (factor != 1)
+            {
+                res = factor;
+                if (factor != *_gwstate.N)
+                    return true;
+                ret = true;
+            }
+        return ret;
+    }
+
+    void EdECMStage1::run_group(GWState& gwstate, int first, int count, int W, std::vector<int16_t>& naf_w, int seed)
+    {
+        int i, k;
+        GWArithmetic gw(gwstate);
+        EdwardsArithmetic ed(gw);
+
+        // A curve that fails to generate or normalize has its divisor as the residue and drops out.
+        std::vector<std::unique_ptr<EdPoint>> P;
+        for (k = 0; k < count; k++)
+        {
+            try
+            {
+                P.emplace_back(new EdPoint(ed.gen_curve(seed + first + k, nullptr)));
+            }
+            catch (const NoInverseException& e)
+            {
+                P.emplace_back();
+                _residues[first + k] = e.divisor;
+            }
+        }
+
+        // Dictionaries
+        std::vector<std::vector<std::unique_ptr<EdPoint>>> u(count);
+        std::vector<std::unique_ptr<EdPoint>> res;
+        for (k = 0; k < count; k++)
+        {
+            res.emplace_back(new EdPoint(ed));
+            if (P[k])
+                ed.mul_dictionary(*P[k], W, u[k], *res[k]);
+        }
+        if (naf_w.size() > 100)
+        {
+            std::vector<EdPoint*> dict;
+            for (k = 0; k < count; k++)
+                for (auto& p : u[k])
+                    dict.push_back(p.get());
+            try
+            {
+                ed.normalize(dict.begin(), dict.end(), 0);
+            }
+            catch (const NoInverseException&)
+            {
+                for (k = 0; k < count; k++)
+                    if (P[k])
+                        try
+                        {
+                            ed.normalize(u[k].begin(), u[k].end(), 0);
+                        }
+                        catch (const NoInverseException& e)
+                        {
+                            P[k].reset();
+                            _residues[first + k] = e.divisor;
+                        }
+            }
+        }
+
+        // Signed window, one digit at a time for all curves.
+        for (k = 0; k < count; k++)
+            if (P[k])
+                ed.copy(*u[k][naf_w.back()/2], *res[k]);
+        for (i = (int)naf_w.size() - 2; i >= 0; i--)
+            for (k = 0; k < count; k++)
+                if (P[k])
+                    ed.mul_step(*res[k], W, naf_w[i], u[k], i == 0);
+
+        for (k = 0; k < count; k++)
+            if (P[k])
+                _residues[first + k] = *res[k]->X;
+    }
 
     GWNum EdwardsArithmetic::jinvariant(GWNum& ed_d)
     {
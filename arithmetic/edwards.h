@@ -26,14 +26,22 @@ namespace arithmetic
         virtual void init(const GWNum& X, const GWNum& Y, EdPoint& res);
         virtual void init(const GWNum& X, const GWNum& Y, const GWNum& Z, const GWNum& T, EdPoint& res);
         virtual int cmp(const EdPoint& a, const EdPoint& b);
+        virtual bool eq(const EdPoint& a, const EdPoint& b);
         virtual void add(EdPoint& a, EdPoint& b, EdPoint& res) override;
         virtual void sub(EdPoint& a, EdPoint& b, EdPoint& res) override;
         virtual void add(EdPoint& a, EdPoint& b, EdPoint& res, int options);
         virtual void neg(EdPoint& a, EdPoint& res) override;
         virtual void dbl(EdPoint& a, EdPoint& res) override;
         virtual void dbl(EdPoint& a, EdPoint& res, int options);
+        using GroupArithmetic<EdPoint>::mul;
         virtual void mul(EdPoint& a, Giant& b, EdPoint& res);
         virtual void mul(EdPoint& a, int W, std::vector<int16_t>& naf_w, EdPoint& res) override;
+        virtual void mul(EdPoint& a, std::vector<int8_t>& jsf_a, EdPoint& b, std::vector<int8_t>& jsf_b, EdPoint& res) override;
+        // Signed window pieces of mul(): window width for a len-bit scalar, dictionary of odd multiples of a
+        // (tmp is scratch), and one NAF digit applied to res. The last digit leaves res normalized for extended addition.
+        static int mul_W(int len);
+        void mul_dictionary(EdPoint& a, int W, std::vector<std::unique_ptr<EdPoint>>& u, EdPoint& tmp);
+        void mul_step(EdPoint& res, int W, int digit, std::vector<std::unique_ptr<EdPoint>>& u, bool last);
 
         virtual void normalize(EdPoint& a, int options);
         template <typename Iter>
@@ -94,11 +102,11 @@ namespace arithmetic
 
         friend bool operator == (EdPoint& a, EdPoint& b)
         {
-            return a.arithmetic().cmp(a, b) == 0;
+            return a.arithmetic().eq(a, b);
         }
         friend bool operator != (EdPoint& a, EdPoint& b)
         {
-            return a.arithmetic().cmp(a, b) != 0;
+            return !a.arithmetic().eq(a, b);
         }
         EdPoint& normalize()
         {
@@ -130,6 +138,68 @@ namespace arithmetic
         std::unique_ptr<GWNum> T;
     };
 
+    // Lim-Lee comb for a fixed base point P. Entry j - 1 of the table is the sum of 2^(i*columns)*P over the bits i set in j,
+    // so a scalar of up to teeth*columns bits costs columns doublings and at most columns additions. Longer scalars fall
+    // back to EdwardsArithmetic::mul() from P.
+    class EdComb
+    {
+    public:
+        EdComb(EdwardsArithmetic& arithmetic, bool fft = false) : _arithmetic(arithmetic), _fft(fft) { }
+        EdComb(EdwardsArithmetic& arithmetic, EdPoint& a, int bits, int teeth, bool fft = false) : _arithmetic(arithmetic)
+        {
+            init(a, bits, teeth, fft);
+        }
+
+        void init(EdPoint& a, int bits, int teeth, bool fft = false);
+        void init(int teeth, int columns, bool fft);
+        void mul(Giant& b, EdPoint& res);
+
+        EdwardsArithmetic& arithmetic() const { return _arithmetic; }
+        int teeth() const { return _teeth; }
+        int columns() const { return _columns; }
+        int bits() const { return _teeth*_columns; }
+        bool fft() const { return _fft; }
+        // Coordinates are in extended form with Z = 1, pre-FFTed if fft() is set.
+        const std::vector<std::unique_ptr<EdPoint>>& table() const { return _table; }
+        std::vector<std::unique_ptr<EdPoint>>& table() { return _table; }
+
+    private:
+        EdwardsArithmetic& _arithmetic;
+        int _teeth = 0;
+        int _columns = 0;
+        bool _fft = false;
+        std::vector<std::unique_ptr<EdPoint>> _table;
+    };
+
+    // ECM stage 1 on many curves in lockstep. The curves of a group follow the same NAF chain, share one inversion
+    // to normalize their dictionaries and one gcd at the end. Each group runs on its own thread, the helper threads
+    // use single-threaded clones of the gwnum state.
+    class EdECMStage1
+    {
+    public:
+        EdECMStage1(GWState& gwstate, int curves, int threads = 1) : _gwstate(gwstate), _curves(curves > 0 ? curves : 0), _threads(threads < 1 ? 1 : threads < curves ? threads : curves > 0 ? curves : 1) { }
+
+        void run(Giant& exp, int seed);
+        bool found(Giant& res);
+
+        int curves() { return _curves; }
+        int threads() { return _threads; }
+        // gcd(X, N) for each curve after run(), 1 if the curve found nothing.
+        std::vector<Giant>& factors() { return _factors; }
+        // X of exp*P for each curve after run(), or the divisor that stopped the curve.
+        std::vector<Giant>& residues() { return _residues; }
+
+    private:
+        void run_group(GWState& gwstate, int first, int count, int W, std::vector<int16_t>& naf_w, int seed);
+
+    private:
+        GWState& _gwstate;
+        int _curves;
+        int _threads;
+        std::vector<Giant> _residues;
+        std::vector<Giant> _factors;
+    };
+
 #ifdef NESTED_EDWARDS
     class NestedEdwardsArithmetic : public EdwardsArithmetic
     {
@@ -16,6 +16,8 @@ namespace arithmetic
         virtual void init(const std::string& a, Element& res) = 0;
         virtual int cmp(const Element& a, const Element& b) = 0;
         virtual int cmp(const Element& a, int32_t b) = 0;
+        virtual bool eq(const Element& a, const Element& b) { return cmp(a, b) == 0; }
+        virtual bool eq(const Element& a, int32_t b) { return cmp(a, b) == 0; }
         virtual void add(Element& a, Element& b, Element& res) = 0;
         virtual void add(Element& a, int32_t b, Element& res) = 0;
         virtual void sub(Element& a, Element& b, Element& res) = 0;
@@ -54,12 +56,12 @@ namespace arithmetic
 
         friend bool operator == (const Element& a, const Element& b)
         {
-            return a.arithmetic().cmp(a, b) == 0;
+            return a.arithmetic().eq(a, b);
         }
 
         friend bool operator != (const Element& a, const Element& b)
         {
-            return a.arithmetic().cmp(a, b) != 0;
+            return !a.arithmetic().eq(a, b);
         }
 
         friend bool operator > (const Element& a, const Element& b)
@@ -84,12 +86,12 @@ namespace arithmetic
 
         friend bool operator == (const Element& a, int b)
         {
-            return a.arithmetic().cmp(a, b) == 0;
+            return a.arithmetic().eq(a, b);
         }
 
         friend bool operator != (const Element& a, int b)
         {
-            return a.arithmetic().cmp(a, b) != 0;
+            return !a.arithmetic().eq(a, b);
         }
 
         friend bool operator > (const Element& a, int b)
@@ -114,12 +116,12 @@ namespace arithmetic
 
         friend bool operator == (int a, const Element& b)
         {
-            return b.arithmetic().cmp(b, a) == 0;
+            return b.arithmetic().eq(b, a);
         }
 
         friend bool operator != (int a, const Element& b)
         {
-            return b.arithmetic().cmp(b, a) != 0;
+            return !b.arithmetic().eq(b, a);
         }
 
         friend bool operator > (int a, const Element& b)
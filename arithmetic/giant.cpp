@@ -1,8 +1,14 @@
 
 #include <cmath>
+#include <chrono>
 #include <vector>
+#include <memory>
+#include <mutex>
 #include <string.h>
 #include <stdlib.h>
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
 #include "gwnum.h"
 #include "cpuid.h"
 #include "giant.h"
@@ -62,7 +68,8 @@ namespace arithmetic
 
     void GiantsArithmetic::free(Giant& a)
     {
-        ::free(a._data);
+        if (a._data != a._inline)
+            ::free(a._data);
         a._capacity = 0;
         a._size = 0;
         a._data = nullptr;
@@ -74,8 +81,20 @@ namespace arithmetic
             capacity = this->capacity();
         if (a._capacity >= capacity)
             return;
+        if (a._data == nullptr && capacity <= Giant::INLINE_CAPACITY)
+        {
+            a._capacity = Giant::INLINE_CAPACITY;
+            a._data = a._inline;
+            return;
+        }
+        if (a._data == a._inline)
+        {
+            a._data = (uint32_t*)malloc(capacity*sizeof(uint32_t));
+            memcpy(a._data, a._inline, abs(a._size)*sizeof(uint32_t));
+        }
+        else
+            a._data = (uint32_t*)realloc(a._data, capacity*sizeof(uint32_t));
         a._capacity = capacity;
-        a._data = (uint32_t*)realloc(a._data, capacity*sizeof(uint32_t));
     }
 
     void GiantsArithmetic::copy(const Giant& a, Giant& res)
@@ -101,6 +120,14 @@ namespace arithmetic
     {
         if (&res == &a)
             return;
+        if (a._data == a._inline)
+        {
+            copy(a, res);
+            a._capacity = 0;
+            a._size = 0;
+            a._data = nullptr;
+            return;
+        }
         if (!res.empty())
             free(res);
         res._capacity = a._capacity;
@@ -138,7 +165,43 @@ namespace arithmetic
     void GiantsArithmetic::init(const std::string& a, Giant& res)
     {
         alloc(res, ((int)a.length() + 8)/9);
-        ctog(a.data(), giant(res));
+        size_t start = !a.empty() && (a[0] == '-' || a[0] == '+') ? 1 : 0;
+        if (a.length() - start < RADIX_THRESHOLD*RADIX_BASE_DIGITS || a.find_first_not_of("0123456789", start) != std::string::npos)
+        {
+            ctog(a.data(), giant(res));
+            return;
+        }
+
+        // Chunks of RADIX_BASE_DIGITS digits, least significant first, joined pairwise with the power-of-10 tree.
+        GiantsArithmetic giants;
+        std::vector<Giant> pieces;
+        for (size_t end = a.length(); end > start; )
+        {
+            size_t begin = end - start > RADIX_BASE_DIGITS ? end - RADIX_BASE_DIGITS : start;
+            pieces.emplace_back(giants);
+            giants.init(a.substr(begin, end - begin), pieces.back());
+            end = begin;
+        }
+        Giant power(giants);
+        Giant tmp(giants);
+        giants.init(10, power);
+        giants.power(power, RADIX_BASE_DIGITS, power);
+        while (pieces.size() > 1)
+        {
+            for (size_t i = 0; i < pieces.size()/2; i++)
+            {
+                giants.mul(pieces[2*i + 1], power, tmp);
+                giants.add(pieces[2*i], tmp, pieces[i]);
+            }
+            if (pieces.size() & 1)
+                giants.move(std::move(pieces.back()), pieces[pieces.size()/2]);
+            pieces.resize((pieces.size() + 1)/2, Giant(giants));
+            if (pieces.size() > 1)
+                giants.mul(power, power, power);
+        }
+        if (a[0] == '-')
+            giants.neg(pieces[0], pieces[0]);
+        res.arithmetic().copy(pieces[0], res);
     }
 
     void GiantsArithmetic::init(uint32_t* data, int size, Giant& res)
@@ -167,6 +230,60 @@ namespace arithmetic
     {
         if (a.empty())
             return "";
+        if (abs(a._size) >= RADIX_THRESHOLD*RADIX_BASE_DIGITS/9)
+        {
+            // Split by powers 10^(RADIX_BASE_DIGITS*2^i) level by level, so giants keeps the divisor reciprocal for the whole level.
+            GiantsArithmetic giants;
+            std::vector<Giant> powers;
+            powers.emplace_back(giants);
+            giants.init(10, powers.back());
+            giants.power(powers.back(), RADIX_BASE_DIGITS, powers.back());
+            while (2*abs(powers.back()._size) - 1 <= abs(a._size))
+            {
+                powers.emplace_back(giants);
+                giants.mul(powers[powers.size() - 2], powers[powers.size() - 2], powers.back());
+            }
+
+            std::vector<Giant> pieces;
+            pieces.emplace_back(giants);
+            giants.copy(a, pieces[0]);
+            if (a._size < 0)
+                giants.neg(pieces[0], pieces[0]);
+            Giant tmp(giants);
+            for (int level = (int)powers.size() - 1; level >= 0; level--)
+            {
+                std::vector<Giant> next;
+                next.reserve(pieces.size()*2);
+                for (auto& piece : pieces)
+                {
+                    next.emplace_back(giants);
+                    next.emplace_back(giants);
+                    giants.div(piece, powers[level], next[next.size() - 2]);
+                    giants.mul(next[next.size() - 2], powers[level], tmp);
+                    giants.sub(piece, tmp, next.back());
+                }
+                pieces = std::move(next);
+            }
+
+            std::string res(a._size < 0 ? "-" : "");
+            std::vector<char> buffer(RADIX_BASE_DIGITS + 10);
+            bool leading = true;
+            for (auto& piece : pieces)
+            {
+                if (leading && piece._size == 0)
+                    continue;
+                if (piece._size == 0)
+                    strcpy(buffer.data(), "0");
+                else
+                    gtoc(giant(piece), buffer.data(), (int)buffer.size());
+                size_t len = strlen(buffer.data());
+                if (!leading)
+                    res.append(RADIX_BASE_DIGITS - len, '0');
+                res.append(buffer.data(), len);
+                leading = false;
+            }
+            return res;
+        }
         std::vector<char> buffer(abs(a._size)*10 + 10);
         if (a._size == 0)
             buffer[0] = '0';
@@ -480,6 +597,200 @@ namespace arithmetic
         res = (uint32_t)res64;
     }
 
+    SmallPrimeBatch::SmallPrimeBatch(const uint32_t* primes, int count) : _count(count)
+    {
+        GWASSERT(count <= LANES);
+        for (int i = 0; i < LANES; i++)
+        {
+            _p[i] = i < count ? (double)primes[i] : 3.0;
+            _inv[i] = 1.0/_p[i];
+        }
+    }
+
+    // x = r*2^16 + d < 2^48, so floor(x/p) from the rounded reciprocal is off by at most one and x - q*p is exact.
+    static void small_prime_mod_scalar(const uint32_t* data, int size, const double* p, const double* inv, double* r)
+    {
+        int i, j, half;
+        for (j = 0; j < SmallPrimeBatch::LANES; j++)
+            r[j] = 0.0;
+        for (i = size - 1; i >= 0; i--)
+            for (half = 16; half >= 0; half -= 16)
+            {
+                double d = (double)((data[i] >> half) & 0xFFFF);
+                for (j = 0; j < SmallPrimeBatch::LANES; j++)
+                {
+                    double x = r[j]*65536.0 + d;
+                    double t = x - std::floor(x*inv[j])*p[j];
+                    if (t < 0.0)
+                        t += p[j];
+                    else if (t >= p[j])
+                        t -= p[j];
+                    r[j] = t;
+                }
+            }
+    }
+
+#if defined(__x86_64__) || defined(_M_X64)
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512F __attribute__((target("avx512f")))
+#else
+#define TARGET_AVX2
+#define TARGET_AVX512F
+#endif
+
+    TARGET_AVX2 static void small_prime_mod_avx2(const uint32_t* data, int size, const double* p, const double* inv, double* r)
+    {
+        int i, j, half;
+        __m256d vp[4], vinv[4], vr[4];
+        __m256d base = _mm256_set1_pd(65536.0);
+        __m256d zero = _mm256_setzero_pd();
+        for (j = 0; j < 4; j++)
+        {
+            vp[j] = _mm256_load_pd(p + 4*j);
+            vinv[j] = _mm256_load_pd(inv + 4*j);
+            vr[j] = zero;
+        }
+        for (i = size - 1; i >= 0; i--)
+            for (half = 16; half >= 0; half -= 16)
+            {
+                __m256d d = _mm256_set1_pd((double)((data[i] >> half) & 0xFFFF));
+                for (j = 0; j < 4; j++)
+                {
+                    __m256d x = _mm256_add_pd(_mm256_mul_pd(vr[j], base), d);
+                    __m256d t = _mm256_sub_pd(x, _mm256_mul_pd(_mm256_floor_pd(_mm256_mul_pd(x, vinv[j])), vp[j]));
+                    t = _mm256_add_pd(t, _mm256_and_pd(_mm256_cmp_pd(t, zero, _CMP_LT_OQ), vp[j]));
+                    vr[j] = _mm256_sub_pd(t, _mm256_and_pd(_mm256_cmp_pd(t, vp[j], _CMP_GE_OQ), vp[j]));
+                }
+            }
+        for (j = 0; j < 4; j++)
+            _mm256_storeu_pd(r + 4*j, vr[j]);
+    }
+
+    TARGET_AVX512F static void small_prime_mod_avx512(const uint32_t* data, int size, const double* p, const double* inv, double* r)
+    {
+        int i, j, half;
+        __m512d vp[2], vinv[2], vr[2];
+        __m512d base = _mm512_set1_pd(65536.0);
+        __m512d zero = _mm512_setzero_pd();
+        for (j = 0; j < 2; j++)
+        {
+            vp[j] = _mm512_load_pd(p + 8*j);
+            vinv[j] = _mm512_load_pd(inv + 8*j);
+            vr[j] = zero;
+        }
+        for (i = size - 1; i >= 0; i--)
+            for (half = 16; half >= 0; half -= 16)
+            {
+                __m512d d = _mm512_set1_pd((double)((data[i] >> half) & 0xFFFF));
+                for (j = 0; j < 2; j++)
+                {
+                    __m512d x = _mm512_add_pd(_mm512_mul_pd(vr[j], base), d);
+                    __m512d q = _mm512_floor_pd(_mm512_mul_pd(x, vinv[j]));
+                    __m512d t = _mm512_sub_pd(x, _mm512_mul_pd(q, vp[j]));
+                    t = _mm512_mask_add_pd(t, _mm512_cmp_pd_mask(t, zero, _CMP_LT_OQ), t, vp[j]);
+                    vr[j] = _mm512_mask_sub_pd(t, _mm512_cmp_pd_mask(t, vp[j], _CMP_GE_OQ), t, vp[j]);
+                }
+            }
+        for (j = 0; j < 2; j++)
+            _mm512_storeu_pd(r + 8*j, vr[j]);
+    }
+#endif
+
+    void SmallPrimeBatch::mod(const Giant& a, uint32_t* res) const
+    {
+        double r[LANES];
+        int size = a.size();
+#if defined(__x86_64__) || defined(_M_X64)
+        if (CPU_FLAGS & CPU_AVX512F)
+            small_prime_mod_avx512(a.data(), size, _p, _inv, r);
+        else if (CPU_FLAGS & CPU_AVX2)
+            small_prime_mod_avx2(a.data(), size, _p, _inv, r);
+        else
+#endif
+            small_prime_mod_scalar(a.data(), size, _p, _inv, r);
+        for (int i = 0; i < _count; i++)
+            res[i] = (uint32_t)r[i];
+    }
+
+    uint32_t SmallPrimeBatch::divisible(const Giant& a) const
+    {
+        uint32_t res[LANES];
+        uint32_t mask = 0;
+        mod(a, res);
+        for (int i = 0; i < _count; i++)
+            if (res[i] == 0)
+                mask |= 1 << i;
+        return mask;
+    }
+
+    void GiantsArithmetic::mod(Giant& a, const std::vector<uint32_t>& moduli, std::vector<uint32_t>& res)
+    {
+        ProductTree tree(*this, moduli);
+        tree.mod(a, res);
+    }
+
+    ProductTree::ProductTree(GiantsArithmetic& arithmetic, const std::vector<uint32_t>& moduli) : _arithmetic(arithmetic), _moduli(moduli)
+    {
+        // Level 0 holds products of pairs, the last level holds the product of all moduli.
+        _levels.emplace_back();
+        for (size_t i = 0; i < moduli.size(); i += 2)
+        {
+            _levels.back().emplace_back(arithmetic);
+            if (i + 1 < moduli.size())
+                _levels.back().back() = (uint64_t)moduli[i]*moduli[i + 1];
+            else
+                _levels.back().back() = moduli[i];
+        }
+        while (_levels.back().size() > 1)
+        {
+            std::vector<Giant>& prev = _levels.back();
+            std::vector<Giant> level;
+            for (size_t i = 0; i < prev.size(); i += 2)
+            {
+                level.emplace_back(arithmetic);
+                if (i + 1 < prev.size())
+                    arithmetic.mul(prev[i], prev[i + 1], level.back());
+                else
+                    level.back() = prev[i];
+            }
+            _levels.push_back(std::move(level));
+        }
+    }
+
+    void ProductTree::mod(Giant& a, std::vector<uint32_t>& res)
+    {
+        res.resize(_moduli.size());
+        if (_moduli.empty())
+            return;
+        std::vector<Giant> rems;
+        rems.emplace_back(_arithmetic);
+        rems[0] = a;
+        if (a < 0)
+            _arithmetic.neg(rems[0], rems[0]);
+        if (rems[0] >= product())
+            _arithmetic.mod(rems[0], product(), rems[0]);
+        for (int k = (int)_levels.size() - 2; k >= 0; k--)
+        {
+            std::vector<Giant> next;
+            for (size_t i = 0; i < _levels[k].size(); i++)
+            {
+                next.emplace_back(_arithmetic);
+                if (rems[i/2] >= _levels[k][i])
+                    _arithmetic.mod(rems[i/2], _levels[k][i], next.back());
+                else
+                    next.back() = rems[i/2];
+            }
+            rems = std::move(next);
+        }
+        for (size_t i = 0; i < _moduli.size(); i++)
+        {
+            _arithmetic.mod(rems[i/2], _moduli[i], res[i]);
+            if (a < 0 && res[i] != 0)
+                res[i] = _moduli[i] - res[i];
+        }
+    }
+
     void GiantsArithmetic::gcd(Giant& a, Giant& b, Giant& res)
     {
         if (a == 0)
@@ -524,13 +835,268 @@ namespace arithmetic
         ::power(giant(res), b);
     }
 
+    BatchGCD::BatchGCD(GiantsArithmetic& arithmetic, const Giant& N) : _arithmetic(arithmetic), _N(arithmetic)
+    {
+        _N = N;
+    }
+
+    void BatchGCD::add(const Giant& a)
+    {
+        if (_levels.empty())
+            _levels.emplace_back();
+        _levels.resize(1);
+        _built = false;
+        _levels[0].emplace_back(_arithmetic);
+        Giant& leaf = _levels[0].back();
+        leaf = a;
+        if (leaf < 0 || leaf >= _N)
+        {
+            _arithmetic.mod(leaf, _N, leaf);
+            if (leaf < 0)
+                _arithmetic.add(leaf, _N, leaf);
+        }
+    }
+
+    void BatchGCD::build()
+    {
+        if (_built)
+            return;
+        // Level 0 holds the residues, the last level holds their product mod N.
+        while (_levels.back().size() > 1)
+        {
+            std::vector<Giant>& prev = _levels.back();
+            std::vector<Giant> level;
+            for (size_t i = 0; i < prev.size(); i += 2)
+            {
+                level.emplace_back(_arithmetic);
+                if (i + 1 < prev.size())
+                {
+                    _arithmetic.mul(prev[i], prev[i + 1], level.back());
+                    _arithmetic.mod(level.back(), _N, level.back());
+                }
+                else
+                    level.back() = prev[i];
+            }
+            _levels.push_back(std::move(level));
+        }
+        _built = true;
+    }
+
+    bool BatchGCD::gcd(Giant& res)
+    {
+        if (_levels.empty())
+        {
+            res = 1;
+            return false;
+        }
+        build();
+        _arithmetic.gcd(_levels.back()[0], _N, res);
+        return res != 1;
+    }
+
+    void BatchGCD::split(std::vector<Giant>& res)
+    {
+        res.clear();
+        if (_levels.empty())
+            return;
+        build();
+        // Remainder tree descent: a node only matters modulo the gcd of its parent.
+        std::vector<Giant> gcds;
+        gcds.emplace_back(_arithmetic);
+        _arithmetic.gcd(_levels.back()[0], _N, gcds[0]);
+        Giant tmp(_arithmetic);
+        for (int k = (int)_levels.size() - 2; k >= 0; k--)
+        {
+            std::vector<Giant> next;
+            for (size_t i = 0; i < _levels[k].size(); i++)
+            {
+                next.emplace_back(_arithmetic);
+                Giant& g = gcds[i/2];
+                if (g == 1)
+                    next.back() = 1;
+                else if ((i & 1) == 0 && i + 1 == _levels[k].size()) // carried up unchanged
+                    next.back() = g;
+                else
+                {
+                    _arithmetic.mod(_levels[k][i], g, tmp);
+                    _arithmetic.gcd(tmp, g, next.back());
+                }
+            }
+            gcds = std::move(next);
+        }
+        res = std::move(gcds);
+    }
+
+    int GiantsArithmetic::powermod_gw_bits = -1;
+    static std::once_flag powermod_calibrated;
+
+    // gwnum state for the last modulus, one per thread so that concurrent powermods don't share it.
+    static thread_local std::unique_ptr<GWState> powermod_state;
+
+    static void reset_powermod_state()
+    {
+        powermod_state.reset();
+    }
+
     void GiantsArithmetic::powermod(Giant& a, Giant& b, Giant& n, Giant& res)
     {
+        if (n > 0 && b > 0 && n.bitlen() >= POWERMOD_GW_MIN_BITS)
+            std::call_once(powermod_calibrated, []() { if (powermod_gw_bits < 0) calibrate_powermod(); });
+        if (powermod_gw_bits > 0 && n > 0 && b > 0 && n.bitlen() >= powermod_gw_bits)
+        {
+            bool cached = powermod_state && powermod_state->N && *powermod_state->N == n;
+            if (cached || b.bitlen() >= POWERMOD_GW_SETUP_BITS)
+            {
+                try
+                {
+                    powermod_gw(a, b, n, res);
+                    return;
+                }
+                catch (const ArithmeticException&)
+                {
+                    reset_powermod_state();
+                }
+            }
+        }
         alloc(res, abs(n._size));
         copy(a, res);
         ::powermodg(giant(res), giant(b), giant(n));
     }
 
+    void GiantsArithmetic::powermod_gw(Giant& a, Giant& b, Giant& n, Giant& res)
+    {
+        if (!powermod_state || !powermod_state->N || *powermod_state->N != n)
+        {
+            powermod_state.reset(new GWState());
+            powermod_state->will_error_check = true;
+            powermod_state->setup(n);
+        }
+        GWArithmetic gw(*powermod_state);
+
+        Giant tmp(*this);
+        mod(a, n, tmp);
+        if (tmp < 0)
+            add(tmp, n, tmp);
+        int len = b.bitlen();
+        int W = len < 32 ? 2 : len < 128 ? 3 : len < 512 ? 4 : len < 2048 ? 5 : 6;
+
+        // Every multiplication is checked, a roundoff error throws and the caller falls back to powermodg.
+        gw_clear_maxerr(gw.gwdata());
+        gwerror_checking(gw.gwdata(), true);
+
+        // Odd powers a, a^3, ..., a^(2^W - 1).
+        int i, j, k;
+        std::vector<std::unique_ptr<GWNum>> u;
+        for (i = 0; i < (1 << (W - 1)); i++)
+            u.emplace_back(new GWNum(gw));
+        *u[0] = tmp;
+        GWNum X(gw);
+        gw.square(*u[0], X, GWMUL_FFT_S1 | GWMUL_STARTNEXTFFT);
+        for (i = 1; i < (int)u.size(); i++)
+            gw.mul(*u[i - 1], X, *u[i], GWMUL_FFT_S2 | GWMUL_STARTNEXTFFT);
+
+        // Sliding window, left to right. The last multiplication leaves a normalized result.
+        bool first = true;
+        for (i = len - 1; i >= 0; )
+        {
+            if (!b.bit(i))
+            {
+                gw.square(X, X, i > 0 ? GWMUL_STARTNEXTFFT : 0);
+                i--;
+                continue;
+            }
+            j = i - W + 1 > 0 ? i - W + 1 : 0;
+            while (!b.bit(j))
+                j++;
+            int window = 0;
+            for (k = i; k >= j; k--)
+                window = 2*window + (b.bit(k) ? 1 : 0);
+            if (first)
+                X = *u[window/2];
+            else
+            {
+                for (k = i; k >= j; k--)
+                    gw.square(X, X, GWMUL_STARTNEXTFFT);
+                gw.mul(X, *u[window/2], X, GWMUL_FFT_S2 | (j > 0 ? GWMUL_STARTNEXTFFT : 0));
+            }
+            first = false;
+            i = j - 1;
+        }
+
+        gwerror_checking(gw.gwdata(), false);
+        if (gw_get_maxerr(gw.gwdata()) > POWERMOD_GW_MAX_ROUNDOFF || gw_test_illegal_sumout(gw.gwdata()))
+        {
+            gw_clear_maxerr(gw.gwdata());
+            throw ArithmeticException("Roundoff error in powermod.");
+        }
+
+        alloc(res, abs(n._size));
+        init(X, res);
+        if (res >= n)
+            mod(res, n, res);
+    }
+
+    int GiantsArithmetic::calibrate_powermod(int max_bits, int runs)
+    {
+        GiantsArithmetic giants;
+        Giant a(giants);
+        Giant e(giants);
+        Giant n(giants);
+        Giant res(giants);
+        int bits;
+        int i;
+        for (bits = POWERMOD_GW_MIN_BITS; bits <= max_bits; bits *= 2)
+        {
+            giants.init(1, n);
+            giants.shiftleft(n, bits - 1, n);
+            giants.rnd(a, bits - 1);
+            giants.add(n, a, n);
+            if (!n.bit(0))
+                giants.add(n, 1, n);
+            giants.rnd(a, bits - 1);
+            giants.rnd(e, 512);
+
+            // Best of several runs for both, gwnum setup is excluded since repeated calls with the same modulus reuse the state.
+            std::chrono::high_resolution_clock::duration giants_time = std::chrono::hours(1);
+            std::chrono::high_resolution_clock::duration gw_time = std::chrono::hours(1);
+            for (i = 0; i < runs; i++)
+            {
+                auto start = std::chrono::high_resolution_clock::now();
+                giants.alloc(res, abs(n._size));
+                giants.copy(a, res);
+                ::powermodg(giant(res), giant(e), giant(n));
+                auto time = std::chrono::high_resolution_clock::now() - start;
+                if (time < giants_time)
+                    giants_time = time;
+            }
+            try
+            {
+                giants.powermod_gw(a, e, n, res);
+                for (i = 0; i < runs; i++)
+                {
+                    auto start = std::chrono::high_resolution_clock::now();
+                    giants.powermod_gw(a, e, n, res);
+                    auto time = std::chrono::high_resolution_clock::now() - start;
+                    if (time < gw_time)
+                        gw_time = time;
+                }
+            }
+            catch (const ArithmeticException&)
+            {
+                reset_powermod_state();
+                continue;
+            }
+            if (gw_time < giants_time)
+                break;
+        }
+        reset_powermod_state();
+        // gwnum never won below max_bits, the dispatch stays off.
+        if (bits > max_bits)
+            bits = 0;
+        powermod_gw_bits = bits;
+        return bits;
+    }
+
     extern "C"
     {
         struct mt_state {
@@ -604,10 +1170,364 @@ namespace arithmetic
         res._size = i;
     }
 
+    // Jacobi symbol along the Euclidean remainder sequence r1 = n (odd), r2, r3, ... Each remainder enters only
+    // through its power of two e and its odd part mod 8: (r_{i-1}/o_i) = (2/o_i)^e_{i+1} (2/o_{i+1})^e_i (-1)^((o_i-1)(o_{i+1}-1)/4) (r_i/o_{i+1}).
+    struct JacobiSequence
+    {
+        int res = 1;
+        int e = 0;
+        int o8;
+
+        JacobiSequence(int n8) : o8(n8) { }
+
+        void push(int e1, int o1)
+        {
+            if ((e1 & 1) && (o8 == 3 || o8 == 5))
+                res = -res;
+            if ((e & 1) && (o1 == 3 || o1 == 5))
+                res = -res;
+            if ((o8 & 3) == 3 && (o1 & 3) == 3)
+                res = -res;
+            e = e1;
+            o8 = o1;
+        }
+        // Low 64 bits of a nonzero remainder with its lowest set bit at most 60.
+        void push(uint64_t low)
+        {
+            int e1;
+            for (e1 = 0; !(low & 1); e1++, low >>= 1);
+            push(e1, (int)(low & 7));
+        }
+    };
+
+    static uint64_t low64(const Giant& a)
+    {
+        int size = abs(a.size());
+        return size == 0 ? 0 : size == 1 ? a.data()[0] : a.data()[0] + ((uint64_t)a.data()[1] << 32);
+    }
+
+    static void push_remainder(JacobiSequence& seq, const Giant& r)
+    {
+        int e;
+        for (e = 0; !r.bit(e); e++);
+        seq.push(e, (r.bit(e + 1) ? 2 : 0) + (r.bit(e + 2) ? 4 : 0) + 1);
+    }
+
+    // Above this size kronecker() halves the numbers recursively before the Lehmer steps.
+    static const int KRONECKER_HGCD_BITS = 8192;
+
+    // Product of remainder steps, (u, w) -> (A*u + B*w, C*u + D*w).
+    struct RemainderMatrix
+    {
+        Giant A, B, C, D;
+
+        RemainderMatrix(GiantsArithmetic& giants) : A(giants), B(giants), C(giants), D(giants)
+        {
+            A = 1;
+            B = 0;
+            C = 0;
+            D = 1;
+        }
+    };
+
+    // (u, w) = M*(u, w).
+    static void apply(GiantsArithmetic& giants, RemainderMatrix& M, Giant& u, Giant& w)
+    {
+        Giant t1(giants);
+        Giant t2(giants);
+        Giant nu(giants);
+        giants.mul(M.A, u, t1);
+        giants.mul(M.B, w, t2);
+        giants.add(t1, t2, nu);
+        giants.mul(M.C, u, t1);
+        giants.mul(M.D, w, t2);
+        giants.add(t1, t2, w);
+        giants.move(std::move(nu), u);
+    }
+
+    // M = N*M.
+    static void compose(GiantsArithmetic& giants, RemainderMatrix& N, RemainderMatrix& M)
+    {
+        Giant t1(giants);
+        Giant t2(giants);
+        Giant nA(giants);
+        Giant nB(giants);
+        giants.mul(N.A, M.A, t1);
+        giants.mul(N.B, M.C, t2);
+        giants.add(t1, t2, nA);
+        giants.mul(N.A, M.B, t1);
+        giants.mul(N.B, M.D, t2);
+        giants.add(t1, t2, nB);
+        giants.mul(N.C, M.A, t1);
+        giants.mul(N.D, M.C, t2);
+        giants.add(t1, t2, M.C);
+        giants.mul(N.C, M.B, t1);
+        giants.mul(N.D, M.D, t2);
+        giants.add(t1, t2, M.D);
+        giants.move(std::move(nA), M.A);
+        giants.move(std::move(nB), M.B);
+    }
+
+    // Reverts the step (u, w) = (w, u - q*w).
+    static void undo_step(GiantsArithmetic& giants, Giant& q, Giant& u, Giant& w, RemainderMatrix* M)
+    {
+        Giant t(giants);
+        giants.mul(q, u, t);
+        giants.add(t, w, t);
+        giants.move(std::move(u), w);
+        giants.move(std::move(t), u);
+        if (M != nullptr)
+        {
+            giants.mul(q, M->A, t);
+            giants.add(t, M->C, t);
+            giants.move(std::move(M->A), M->C);
+            giants.move(std::move(t), M->A);
+            Giant t2(giants);
+            giants.mul(q, M->B, t2);
+            giants.add(t2, M->D, t2);
+            giants.move(std::move(M->B), M->D);
+            giants.move(std::move(t2), M->B);
+        }
+    }
+
+    static void jacobi_reduce(GiantsArithmetic& giants, Giant& u, Giant& w, int stop, RemainderMatrix& M, std::vector<Giant>& q);
+
+    // Steps of (u, w) taken from the quotients of their bits above k. A remainder sequence with positive quotients
+    // that ends in u > w >= 0 is the Euclidean one, so the trailing quotients that fail this for the full numbers are dropped.
+    static void reduce_top(GiantsArithmetic& giants, Giant& u, Giant& w, int k, int stop, RemainderMatrix& M, std::vector<Giant>& q)
+    {
+        Giant u0(giants);
+        Giant w0(giants);
+        giants.shiftright(u, k, u0);
+        giants.shiftright(w, k, w0);
+        if (w0 == 0)
+            return;
+        RemainderMatrix N(giants);
+        size_t first = q.size();
+        jacobi_reduce(giants, u0, w0, stop, N, q);
+        if (q.size() == first)
+            return;
+        apply(giants, N, u, w);
+        while (q.size() > first && (u <= w || w < 0))
+        {
+            undo_step(giants, q.back(), u, w, &N);
+            q.pop_back();
+        }
+        compose(giants, N, M);
+    }
+
+    // Euclidean steps on u > w >= 0 until w has at most stop bits, may stop earlier. The quotients are appended to q,
+    // the steps are accumulated in M. Large numbers are reduced by two recursive calls on their leading bits.
+    static void jacobi_reduce(GiantsArithmetic& giants, Giant& u, Giant& w, int stop, RemainderMatrix& M, std::vector<Giant>& q)
+    {
+        int n = u.bitlen();
+        if (n > KRONECKER_HGCD_BITS)
+        {
+            int k = n/2;
+            reduce_top(giants, u, w, k, (n - k)/2, M, q);
+            k = 2*stop - u.bitlen();
+            if (w.bitlen() > stop && k > 0)
+                reduce_top(giants, u, w, k, stop - k, M, q);
+            return;
+        }
+
+        Giant t1(giants);
+        Giant t2(giants);
+        Giant f(giants);
+        Giant g(giants);
+        RemainderMatrix L(giants);
+        while (w != 0 && w.bitlen() > stop)
+        {
+            int shift = u.bitlen() > 32 ? u.bitlen() - 32 : 0;
+            giants.shiftright(u, shift, t1);
+            giants.shiftright(w, shift, t2);
+            int64_t x = (int64_t)low64(t1);
+            int64_t y = (int64_t)low64(t2);
+            int64_t A = 1, B = 0, C = 0, D = 1, Q, T, T2;
+            size_t first = q.size();
+            while (y + C > 0 && y + D > 0 && x + A >= 0 && x + B >= 0)
+            {
+                Q = (x + A)/(y + C);
+                if (Q != (x + B)/(y + D))
+                    break;
+                T = x - Q*y;
+                // Leading bits of the next remainder at or below stop.
+                if (shift > 0 && stop - shift > 0 && (stop - shift >= 32 || (T >> (stop - shift)) == 0))
+                    break;
+                q.emplace_back(giants);
+                giants.init((uint64_t)Q, q.back());
+                T2 = A - Q*C; A = C; C = T2;
+                T2 = B - Q*D; B = D; D = T2;
+                x = y; y = T;
+            }
+            if (B == 0)
+            {
+                q.resize(first);
+                q.emplace_back(giants);
+                giants.div(u, w, q.back());
+                giants.mul(q.back(), w, t1);
+                giants.sub(u, t1, t1);
+                giants.move(std::move(w), u);
+                giants.move(std::move(t1), w);
+                giants.mul(q.back(), M.C, t1);
+                giants.sub(M.A, t1, t1);
+                giants.move(std::move(M.C), M.A);
+                giants.move(std::move(t1), M.C);
+                giants.mul(q.back(), M.D, t1);
+                giants.sub(M.B, t1, t1);
+                giants.move(std::move(M.D), M.B);
+                giants.move(std::move(t1), M.D);
+                continue;
+            }
+            giants.init(A, L.A);
+            giants.init(B, L.B);
+            giants.init(C, L.C);
+            giants.init(D, L.D);
+            apply(giants, L, u, w);
+            compose(giants, L, M);
+        }
+    }
+
     int GiantsArithmetic::kronecker(Giant& a, Giant& b)
     {
-        GWASSERT(0);
-        return 0;
+        GiantsArithmetic giants;
+        int res = 1;
+        int a8 = a == 0 ? 0 : (int)(a.data()[0] & 7);
+        if (a < 0)
+            a8 = (8 - a8) & 7;
+        if (b == 0)
+            return a == 1 || a == -1 ? 1 : 0;
+        if (!a.bit(0) && !b.bit(0))
+            return 0;
+
+        // Kronecker to Jacobi: strip the power of two and the sign of b.
+        int v;
+        for (v = 0; !b.bit(v); v++);
+        if ((v & 1) && (a8 == 3 || a8 == 5))
+            res = -res;
+        if (b < 0 && a < 0)
+            res = -res;
+        Giant u(giants);
+        Giant w(giants);
+        giants.copy(b, u);
+        if (u < 0)
+            giants.neg(u, u);
+        if (v > 0)
+            giants.shiftright(u, v, u);
+        if (u == 1)
+            return res;
+        giants.copy(a, w);
+        if (w < 0)
+        {
+            giants.neg(w, w);
+            if (u.bit(1))
+                res = -res;
+        }
+        if (w >= u)
+            giants.mod(w, u, w);
+
+        // (w/u) along the remainder sequence of (u, w). Large numbers are halved by jacobi_reduce(), then Lehmer steps follow.
+        JacobiSequence seq((int)(low64(u) & 7));
+        Giant t1(giants);
+        Giant t2(giants);
+        Giant f(giants);
+        if (w != 0)
+            push_remainder(seq, w);
+        while (w != 0 && u.bitlen() > 64)
+        {
+            if (u.bitlen() > KRONECKER_HGCD_BITS)
+            {
+                RemainderMatrix M(giants);
+                std::vector<Giant> q;
+                uint64_t ulow = low64(u);
+                uint64_t wlow = low64(w);
+                jacobi_reduce(giants, u, w, u.bitlen()/2, M, q);
+                // The low 64 bits of each remainder follow from the quotients.
+                size_t i;
+                for (i = 0; i < q.size(); i++)
+                {
+                    uint64_t r = ulow - low64(q[i])*wlow;
+                    if ((r & 0x1FFFFFFFFFFFFFFFULL) == 0)
+                        break;
+                    seq.push(r);
+                    ulow = wlow;
+                    wlow = r;
+                }
+                // A remainder without a set bit in its low 61 bits is left to the exact step below.
+                while (q.size() > i)
+                {
+                    undo_step(giants, q.back(), u, w, nullptr);
+                    q.pop_back();
+                }
+                if (i > 0)
+                    continue;
+            }
+            int shift = u.bitlen() - 32;
+            giants.shiftright(u, shift, t1);
+            giants.shiftright(w, shift, t2);
+            int64_t x = (int64_t)low64(t1);
+            int64_t y = (int64_t)low64(t2);
+            uint64_t ulow = low64(u);
+            uint64_t wlow = low64(w);
+            int64_t A = 1, B = 0, C = 0, D = 1, q, T, T2;
+            // Knuth's algorithm L, quotients accepted only when both bracketing ratios agree.
+            while (y + C > 0 && y + D > 0 && x + A >= 0 && x + B >= 0)
+            {
+                q = (x + A)/(y + C);
+                if (q != (x + B)/(y + D))
+                    break;
+                T = A - q*C;
+                T2 = B - q*D;
+                uint64_t low = (uint64_t)T*ulow + (uint64_t)T2*wlow;
+                if ((low & 0x1FFFFFFFFFFFFFFFULL) == 0)
+                    break;
+                seq.push(low);
+                A = C; C = T;
+                B = D; D = T2;
+                T = x - q*y; x = y; y = T;
+            }
+            if (B == 0)
+            {
+                giants.mod(u, w, t1);
+                if (t1 != 0)
+                    push_remainder(seq, t1);
+                giants.move(std::move(w), u);
+                giants.move(std::move(t1), w);
+                continue;
+            }
+            // u, w = A*u + B*w, C*u + D*w; the cofactors in each row have opposite signs.
+            auto combine = [&](int64_t P, int64_t Q, Giant& res)
+            {
+                giants.init((uint64_t)(P < 0 ? -P : P), f);
+                giants.mul(u, f, t1);
+                giants.init((uint64_t)(Q < 0 ? -Q : Q), f);
+                giants.mul(w, f, t2);
+                if (P > 0 || Q < 0)
+                    giants.sub(t1, t2, res);
+                else
+                    giants.sub(t2, t1, res);
+            };
+            Giant nu(giants);
+            combine(A, B, nu);
+            combine(C, D, w);
+            giants.move(std::move(nu), u);
+        }
+        // Both u and w are already in the sequence.
+        if (w != 0)
+        {
+            uint64_t x = low64(u);
+            uint64_t y = low64(w);
+            while (y != 0)
+            {
+                uint64_t r = x%y;
+                x = y;
+                y = r;
+                if (r != 0)
+                    seq.push(r);
+            }
+            return x == 1 ? res*seq.res : 0;
+        }
+        return u == 1 ? res*seq.res : 0;
     }
 
     int GiantsArithmetic::kronecker(Giant& a, uint32_t b)
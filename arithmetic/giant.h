@@ -57,6 +57,7 @@ namespace arithmetic
         virtual void div(Giant& a, uint32_t b, Giant& res);
         virtual void mod(Giant& a, Giant& b, Giant& res) override;
         virtual void mod(Giant& a, uint32_t b, uint32_t& res);
+        virtual void mod(Giant& a, const std::vector<uint32_t>& moduli, std::vector<uint32_t>& res);
         virtual void gcd(Giant& a, Giant& b, Giant& res) override;
         virtual void inv(Giant& a, Giant& n, Giant& res) override;
         virtual void power(Giant& a, int32_t b, Giant& res);
@@ -73,7 +74,22 @@ namespace arithmetic
 
         int capacity() const { return _capacity; }
 
+        static const int RADIX_BASE_DIGITS = 288;
+        static const int RADIX_THRESHOLD = 8;
+
+        // powermod() switches to roundoff-checked gwnum for moduli of at least powermod_gw_bits bits, 0 keeps it off.
+        // The first modulus of POWERMOD_GW_MIN_BITS or more runs calibrate_powermod() unless the value was set before.
+        // Without a cached state for the modulus the exponent must also be long enough to pay for the setup.
+        // The state is cached per thread.
+        static int powermod_gw_bits;
+        static const int POWERMOD_GW_MIN_BITS = 1024;
+        static const int POWERMOD_GW_SETUP_BITS = 256;
+        static constexpr double POWERMOD_GW_MAX_ROUNDOFF = 0.4;
+        static int calibrate_powermod(int max_bits = 65536, int runs = 3);
+
     protected:
+        void powermod_gw(Giant& a, Giant& b, Giant& n, Giant& res);
+
         void* _rnd_state = nullptr;
         int _capacity = 0;
     };
@@ -484,5 +500,75 @@ namespace arithmetic
         {
             return b.arithmetic().kronecker(a, b);
         }
+
+    public:
+        static const int INLINE_CAPACITY = 4;
+
+    private:
+        uint32_t _inline[INLINE_CAPACITY];
+    };
+    // Reduces a Giant by up to LANES primes below 2^32 at once. Each lane keeps its remainder in a double
+    // and reduces 16 bits at a time with a precomputed 1/p, using AVX2 or AVX-512F when the CPU has them.
+    class SmallPrimeBatch
+    {
+    public:
+        static const int LANES = 16;
+
+    public:
+        SmallPrimeBatch(const uint32_t* primes, int count);
+
+        int count() const { return _count; }
+        uint32_t prime(int i) const { return (uint32_t)_p[i]; }
+        void mod(const Giant& a, uint32_t* res) const;
+        uint32_t divisible(const Giant& a) const;
+
+    private:
+        int _count;
+        alignas(64) double _p[LANES];
+        alignas(64) double _inv[LANES];
+    };
+
+    // Products of pairs of moduli up to the product of all. Reduces a Giant by every modulus at once.
+    class ProductTree
+    {
+    public:
+        ProductTree(GiantsArithmetic& arithmetic, const std::vector<uint32_t>& moduli);
+
+        void mod(Giant& a, std::vector<uint32_t>& res);
+
+        GiantsArithmetic& arithmetic() { return _arithmetic; }
+        const std::vector<uint32_t>& moduli() { return _moduli; }
+        Giant& product() { return _levels.back()[0]; }
+
+    private:
+        GiantsArithmetic& _arithmetic;
+        std::vector<uint32_t> _moduli;
+        std::vector<std::vector<Giant>> _levels;
+    };
+
+    // Accumulates residues mod N and looks for common factors with N by one gcd for the whole batch.
+    // Individual gcds are computed only down the branches of the product tree where the batch gcd is nontrivial.
+    class BatchGCD
+    {
+    public:
+        BatchGCD(GiantsArithmetic& arithmetic, const Giant& N);
+
+        void add(const Giant& a);
+        void clear() { _levels.clear(); _built = false; }
+        bool gcd(Giant& res);
+        void split(std::vector<Giant>& res);
+
+        GiantsArithmetic& arithmetic() { return _arithmetic; }
+        Giant& N() { return _N; }
+        size_t size() { return _levels.empty() ? 0 : _levels[0].size(); }
+
+    private:
+        void build();
+
+    private:
+        GiantsArithmetic& _arithmetic;
+        Giant _N;
+        std::vector<std::vector<Giant>> _levels;
+        bool _built = false;
     };
 }
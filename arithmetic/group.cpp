@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <thread>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#ifdef _WIN32
+#include "windows.h"
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "gwnum.h"
+#include "group.h"
+#include "integer.h"
+#include "exception.h"
+
+namespace arithmetic
+{
+    // Chain length of e with the step rules of DifferentialGroupArithmetic::mul(), or maxlen + 1 if it's longer.
+    static int DAC_chain_len(int e, int d, int maxlen)
+    {
+        int len = 0;
+        while (d != 0 && len <= maxlen)
+        {
+            if (e/2 < d)
+                d = e - d;
+            else if ((e & 1) == 0 && d < e/4)
+            {
+                e = e/2;
+                len++;
+            }
+            else
+            {
+                e = e - d;
+                len++;
+            }
+        }
+        // Only coprime d reaches e = 1.
+        return d == 0 && e == 1 ? len : maxlen + 1;
+    }
+
+    // Shortest chains of p stay within DAC_len_base(p) plus a small slack that generate() measures.
+    static int DAC_len_base(int p)
+    {
+        return (int)(1.3*std::log2((double)p));
+    }
+
+    // Searches d in [start, end] for the shortest DAC chain of e, returns d and stores the chain length in *maxlen.
+    // Candidates longer than *maxlen are cut short, the shortest one is returned if none fits.
+    static int DAC_search_d(int e, int start, int end, int *maxlen)
+    {
+        if (start < 1)
+            start = 1;
+        if (end > e - 1)
+            end = e - 1;
+        int best = 0;
+        int best_len = *maxlen;
+        for (int d = start; d <= end; d++)
+        {
+            int len = DAC_chain_len(e, d, best_len);
+            if (len < best_len || (best == 0 && len == best_len))
+            {
+                best = d;
+                best_len = len;
+            }
+        }
+        if (best == 0)
+        {
+            best_len = INT_MAX - 1;
+            for (int d = start; d <= end; d++)
+            {
+                int len = DAC_chain_len(e, d, best_len);
+                if (len < best_len)
+                {
+                    best = d;
+                    best_len = len;
+                }
+            }
+        }
+        *maxlen = best_len;
+        return best;
+    }
+
+    bool DACDatabase::generate(int max_prime, int threads)
+    {
+        close();
+        PrimeList primes(max_prime + 1);
+        _count = primes.size();
+        _max_prime = max_prime;
+        _data.resize(_count);
+        std::atomic<bool> failed(false);
+        std::atomic<int> len_slack(0);
+
+        // Each thread takes a contiguous range of prime indices.
+        auto search = [&](size_t first, size_t last)
+        {
+            for (auto it = PrimeList::const_iterator(primes, first); it.pos() < last; it++)
+            {
+                int p = *it;
+                int offset = 0;
+                if (p >= 14)
+                {
+                    int len = 60;
+                    int e = (int)(p/1.618);
+                    offset = DAC_search_d(p, e - OFFSET_RANGE, e + OFFSET_RANGE, &len) - e;
+                    if (offset < -OFFSET_RANGE || offset > OFFSET_RANGE || offset < INT8_MIN || offset > INT8_MAX)
+                    {
+                        failed = true;
+                        return;
+                    }
+                    int slack = len - DAC_len_base(p);
+                    int cur = len_slack;
+                    while (slack > cur && !len_slack.compare_exchange_weak(cur, slack));
+                }
+                _data[it.pos()] = (int8_t)offset;
+            }
+        };
+        if (threads < 1)
+            threads = 1;
+        std::vector<std::thread> helpers;
+        size_t chunk = (_count + threads - 1)/threads;
+        for (int i = 1; i < threads && i*chunk < _count; i++)
+            helpers.emplace_back(search, i*chunk, (i + 1)*chunk < _count ? (i + 1)*chunk : _count);
+        search(0, chunk < _count ? chunk : _count);
+        for (auto& helper : helpers)
+            helper.join();
+        if (failed)
+        {
+            close();
+            return false;
+        }
+        _offsets = _data.data();
+        _len_slack = len_slack;
+        return true;
+    }
+
+    int DACDatabase::d(int prime, int index)
+    {
+        // Any 0 < d < prime gives a chain for prime, an entry of another prime only makes it longer.
+        // Most such entries exceed the length bound of the table and are rejected, so the caller searches instead.
+        if (!contains(index) || prime < 14 || prime > _max_prime)
+            return 0;
+        int d = (int)(prime/1.618) + _offsets[index];
+        int maxlen = DAC_len_base(prime) + _len_slack;
+        if (d <= 0 || d >= prime || DAC_chain_len(prime, d, maxlen) > maxlen)
+            return 0;
+        return d;
+    }
+
+    bool DACDatabase::save(const std::string& filename)
+    {
+        FILE* file = fopen(filename.data(), "wb");
+        if (file == nullptr)
+            return false;
+        Header header = { MAGIC, VERSION, (uint32_t)_count, (uint32_t)_max_prime, (uint32_t)_len_slack };
+        bool ok = fwrite(&header, sizeof(Header), 1, file) == 1 && fwrite(_offsets, 1, _count, file) == _count;
+        fclose(file);
+        return ok;
+    }
+
+    bool DACDatabase::load(const std::string& filename)
+    {
+        close();
+#ifdef _WIN32
+        HANDLE file = CreateFileA(filename.data(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER size;
+        GetFileSizeEx(file, &size);
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        CloseHandle(file);
+        if (mapping == NULL)
+            return false;
+        _map = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping);
+        if (_map == nullptr)
+            return false;
+        _map_size = (size_t)size.QuadPart;
+#else
+        int fd = open(filename.data(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Header))
+        {
+            ::close(fd);
+            return false;
+        }
+        _map = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (_map == MAP_FAILED)
+        {
+            _map = nullptr;
+            return false;
+        }
+        _map_size = (size_t)st.st_size;
+#endif
+        const Header* header = (const Header*)_map;
+        if (_map_size < sizeof(Header) || header->magic != MAGIC || header->version != VERSION || _map_size < sizeof(Header) + header->count)
+        {
+            close();
+            return false;
+        }
+        _count = header->count;
+        _max_prime = (int)header->max_prime;
+        _len_slack = (int)header->len_slack;
+        _offsets = (const int8_t*)_map + sizeof(Header);
+        return true;
+    }
+
+    void DACDatabase::close()
+    {
+        if (_map != nullptr)
+        {
+#ifdef _WIN32
+            UnmapViewOfFile(_map);
+#else
+            munmap(_map, _map_size);
+#endif
+        }
+        _map = nullptr;
+        _map_size = 0;
+        _data.clear();
+        _offsets = nullptr;
+        _count = 0;
+        _max_prime = 0;
+        _len_slack = 0;
+    }
+}
@@ -2,12 +2,14 @@
 
 #include <memory>
 #include <vector>
+#include <string>
 
 #include "arithmetic.h"
 
 namespace arithmetic
 {
     void get_NAF_W(int W, Giant& a, std::vector<int16_t>& res, bool compress = true);
+    void get_JSF(Giant& a, Giant& b, std::vector<int8_t>& res_a, std::vector<int8_t>& res_b);
 
     template<class Element>
     class GroupArithmetic
@@ -55,6 +57,56 @@ namespace arithmetic
                     dbl(res, res);
             }
         }
+
+        // x*a + y*b with a shared chain of doublings (Straus-Shamir).
+        virtual void mul(Element& a, Giant& x, Element& b, Giant& y, Element& res)
+        {
+            std::vector<int8_t> jsf_x;
+            std::vector<int8_t> jsf_y;
+            get_JSF(x, y, jsf_x, jsf_y);
+            mul(a, jsf_x, b, jsf_y, res);
+        }
+
+        virtual void mul(Element& a, std::vector<int8_t>& jsf_a, Element& b, std::vector<int8_t>& jsf_b, Element& res)
+        {
+            int i;
+
+            if (jsf_a.empty())
+            {
+                init(res);
+                return;
+            }
+
+            // Dictionary: a, b, a + b, a - b
+            std::vector<std::unique_ptr<Element>> u;
+            for (i = 0; i < 4; i++)
+                u.emplace_back(new Element(a.arithmetic()));
+            copy(a, *u[0]);
+            copy(b, *u[1]);
+            add(a, b, *u[2]);
+            sub(a, b, *u[3]);
+            auto digit = [&](int8_t da, int8_t db) -> Element&
+            {
+                return *u[da == 0 ? 1 : db == 0 ? 0 : da == db ? 2 : 3];
+            };
+
+            // Joint signed binary, the top digit pair is nonzero.
+            i = (int)jsf_a.size() - 1;
+            if (jsf_a[i] < 0 || (jsf_a[i] == 0 && jsf_b[i] < 0))
+                neg(digit(jsf_a[i], jsf_b[i]), res);
+            else
+                copy(digit(jsf_a[i], jsf_b[i]), res);
+            for (i--; i >= 0; i--)
+            {
+                dbl(res, res);
+                if (jsf_a[i] == 0 && jsf_b[i] == 0)
+                    continue;
+                if (jsf_a[i] < 0 || (jsf_a[i] == 0 && jsf_b[i] < 0))
+                    sub(res, digit(jsf_a[i], jsf_b[i]), res);
+                else
+                    add(res, digit(jsf_a[i], jsf_b[i]), res);
+            }
+        }
     };
 
     template<class Arithmetic, class Element>
@@ -193,6 +245,54 @@ namespace arithmetic
     extern const size_t precomputed_DAC_S_d_len;
     extern const int precomputed_DAC_S_d[];
 
+    // Best DAC d for every prime up to a bound, indexed by the prime number index (2 is 0). d is searched
+    // within +-OFFSET_RANGE of p/1.618, so one signed byte per prime is enough. The file is a Header followed by
+    // the offsets and is mapped into memory as is. d() returns 0 for a pair it can't vouch for.
+    class DACDatabase
+    {
+    public:
+        static const uint32_t MAGIC = 0x43414444;
+        static const uint32_t VERSION = 2;
+        static const int OFFSET_RANGE = 100;
+
+        struct Header
+        {
+            uint32_t magic;
+            uint32_t version;
+            uint32_t count;
+            uint32_t max_prime;
+            uint32_t len_slack;
+        };
+
+    public:
+        DACDatabase() { }
+        ~DACDatabase() { close(); }
+
+        bool generate(int max_prime, int threads = 1);
+        bool save(const std::string& filename);
+        bool load(const std::string& filename);
+        void close();
+
+        size_t size() { return _count; }
+        int max_prime() { return _max_prime; }
+        bool contains(int index) { return index >= 0 && (size_t)index < _count; }
+        int d(int prime, int index);
+
+        static DACDatabase* default_database() { return default_ref(); }
+        static void set_default_database(DACDatabase* database) { default_ref() = database; }
+
+    private:
+        std::vector<int8_t> _data;
+        const int8_t* _offsets = nullptr;
+        size_t _count = 0;
+        int _max_prime = 0;
+        int _len_slack = 0;
+        void* _map = nullptr;
+        size_t _map_size = 0;
+
+        static DACDatabase*& default_ref() { static DACDatabase* database = nullptr; return database; }
+    };
+
     template<class Element>
     class DifferentialGroupArithmetic
     {
@@ -203,6 +303,13 @@ namespace arithmetic
         virtual void add(Element& a, Element& b, Element& a_minus_b, Element& res) = 0;
         virtual void dbl(Element& a, Element& res) = 0;
 
+        // res_add = a + b, res_dbl = 2*a or 2*b. res_dbl may alias the doubled operand, res_add the other one.
+        virtual void dbladd(Element& a, Element& b, Element& a_minus_b, Element& res_dbl, Element& res_add, bool dbl_b = false)
+        {
+            add(a, b, a_minus_b, res_add);
+            dbl(dbl_b ? b : a, res_dbl);
+        }
+
         virtual void mul(Element& a, int32_t b, Element& res)
         {
             if (b == 0)
@@ -263,15 +370,17 @@ namespace arithmetic
                 {
                     if (b & i)
                     {
-                        add(res2, res, tmp, res);
                         if (i > j)
-                            dbl(res2, res2);
+                            dbladd(res2, res, tmp, res2, res);
+                        else
+                            add(res2, res, tmp, res);
                     }
                     else
                     {
                         if (i > j)
-                            add(res2, res, tmp, res2);
-                        dbl(res, res);
+                            dbladd(res2, res, tmp, res, res2, true);
+                        else
+                            dbl(res, res);
                     }
                 }
                 for (; i; i >>= 1)
@@ -318,15 +427,9 @@ namespace arithmetic
             for (i = (1 << (len - 1)); i; i >>= 1)
             {
                 if (b & i)
-                {
-                    add(res2, res1, tmp, res1);
-                    dbl(res2, res2);
-                }
+                    dbladd(res2, res1, tmp, res2, res1);
                 else
-                {
-                    add(res2, res1, tmp, res2);
-                    dbl(res1, res1);
-                }
+                    dbladd(res2, res1, tmp, res1, res2, true);
             }
         }
 
@@ -341,12 +444,14 @@ namespace arithmetic
             std::vector<int> chain;
             int len = 60;
             int e = prime;
-            int d = 1;
+            int d = 0;
             if (index < 0)
                 d = -index;
             else if (index > 0 && index < precomputed_DAC_S_d_len)
                 d = precomputed_DAC_S_d[index];
-            else
+            else if (DACDatabase::default_database() != nullptr)
+                d = DACDatabase::default_database()->d(prime, index);
+            if (d == 0)
                 d = get_DAC_S_d(e, (int)(e/1.618) - 100, (int)(e/1.618) + 100, &len);
             while (d != 0)
             {
@@ -382,8 +487,7 @@ namespace arithmetic
                 {
                     ed = ed + e;
                     e = 2*e;
-                    add(Te, ed_init ? Ted : Td, Td, Ted);
-                    dbl(Te, Te);
+                    dbladd(Te, ed_init ? Ted : Td, Td, Te, Ted);
                     ed_init = true;
                 }
                 else if (chain[i] == 1)
@@ -418,15 +522,9 @@ namespace arithmetic
             for (int i = 1; i <= len; i++)
             {
                 if (b.bit(len - i))
-                {
-                    add(res2, res1, tmp, res1);
-                    dbl(res2, res2);
-                }
+                    dbladd(res2, res1, tmp, res2, res1);
                 else
-                {
-                    add(res2, res1, tmp, res2);
-                    dbl(res1, res1);
-                }
+                    dbladd(res2, res1, tmp, res1, res2, true);
             }
         }
 
@@ -1,5 +1,7 @@
 
 #include <cmath>
+#include <mutex>
+#include <string.h>
 #include "integer.h"
 
 namespace arithmetic
@@ -16,7 +18,7 @@ namespace arithmetic
 
     bool is_prime(uint32_t a)
     {
-        for (auto it = PrimeIterator::get(); (uint32_t)*it*(uint32_t)(*it) <= a; it++)
+        for (auto it = PrimeIterator::get(); (*it)*(*it) <= a; it++)
             if (a%(uint32_t)(*it) == 0)
                 return false;
         return true;
@@ -25,7 +27,7 @@ namespace arithmetic
     uint32_t phi(uint32_t N)
     {
         uint32_t res = 1;
-        for (auto it = PrimeIterator::get(); (uint32_t)*it*(uint32_t)(*it) <= N; it++)
+        for (auto it = PrimeIterator::get(); (*it)*(*it) <= N; it++)
             if (N%(uint32_t)(*it) == 0)
             {
                 N /= (uint32_t)*it;
@@ -155,12 +157,30 @@ namespace arithmetic
                 for (j = (i*2 + 1)*(i*2 + 1)/2; j < bitmap.size(); j += i*2 + 1)
                     bitmap[j] = true;
             }
-        primes.clear();
-        primes.reserve(k + 1);
-        primes.push_back(2);
-        for (i = 1; i < max/2; i++)
+        _gaps.clear();
+        _gaps.reserve(k + 1);
+        _checkpoints.clear();
+        _checkpoints.reserve(k/CHECKPOINT + 1);
+        _gaps.push_back(0);
+        _checkpoints.push_back(2);
+        for (i = 1, j = 0; i < max/2; i++)
             if (!bitmap[i])
-                primes.push_back(i*2 + 1);
+            {
+                _gaps.push_back((uint8_t)(j == 0 ? 0 : i - j));
+                if ((_gaps.size() - 1)%CHECKPOINT == 0)
+                    _checkpoints.push_back(i*2 + 1);
+                j = i;
+            }
+        _size = _gaps.size();
+    }
+
+    int PrimeList::operator[] (size_t pos) const
+    {
+        size_t i = pos/CHECKPOINT*CHECKPOINT;
+        int value = _checkpoints[pos/CHECKPOINT];
+        for (; i < pos; i++)
+            value = next(i, value);
+        return value;
     }
 
     template<class T, class IT>
@@ -203,8 +223,8 @@ namespace arithmetic
 
     void PrimeList::sieve_range(int start, int end, std::vector<int>& list)
     {
-        std::vector<int>::iterator it = primes.begin();
-        sieve_range_t<int,std::vector<int>::iterator>(start, end, list, it, primes.size() < 4792 ? primes.end() : primes.begin() + 4792);
+        const_iterator it = cbegin();
+        sieve_range_t<int,const_iterator>(start, end, list, it, _size < 4792 ? cend() : const_iterator(*this, 4792));
     }
 
     PrimeIterator PrimeList::begin()
@@ -222,54 +242,228 @@ namespace arithmetic
         (*this) += 1;
     }
 
+    PrimeIterator::~PrimeIterator()
+    {
+    }
+
     PrimeIterator& PrimeIterator::operator+=(int offset)
     {
+        size_t prev = _cur;
+        if (offset < 0 && _cur < (size_t)-(int64_t)offset)
+            offset = -(int)_cur;
         _cur += offset;
-        if (_cur > 105097564)
-            _cur = 105097564;
         if (_cur < _list.size())
+        {
+            if (offset >= 0 && offset <= PrimeList::CHECKPOINT)
+                for (; prev < _cur; prev++)
+                    _value = _list.next(prev, _value);
+            else
+                _value = _list[_cur];
+            _sieve.reset();
             return *this;
-        while (_cur - _range_pos >= _range.size())
+        }
+        if (offset < 0 || prev < _list.size())
+        {
+            prev = _list.size() - 1;
+            _value = _list[prev];
+            _sieve.reset();
+        }
+        for (; prev < _cur; prev++)
+            _value = next_sieved();
+        return *this;
+    }
+
+    uint64_t PrimeIterator::next_sieved()
+    {
+        if (_sieve)
+            ++(*_sieve);
+        while (!_sieve || _sieve->done())
         {
-            int start;
-            if (_range_pos == 0)
+            uint64_t start = _sieve ? _sieve->end() : _value + 1;
+            _sieve.reset(new PrimeSieve(start, start < UINT64_MAX/2 ? 2*start : UINT64_MAX, 0));
+        }
+        return **_sieve;
+    }
+
+    std::unique_ptr<PrimeIterator> _iter_max;
+
+    const PrimeIterator& PrimeIterator::max()
+    {
+        if (!_iter_max)
+        {
+            _iter_max.reset(new PrimeIterator(PrimeList::primes_16bit()));
+            _iter_max->_cur = SIZE_MAX;
+            _iter_max->_value = UINT64_MAX;
+        }
+        return *_iter_max;
+    }
+
+    void PrimeIterator::sieve_range(uint64_t start, uint64_t end, std::vector<uint64_t>& list)
+    {
+        list.clear();
+        for (PrimeSieve sieve(start, end); !sieve.done(); ++sieve)
+            list.push_back(*sieve);
+    }
+
+    // Odd n = 2m + 1 divisible by 3, 5, 7, 11 or 13, indexed by m mod 15015.
+    const std::vector<char>& wheel_pattern()
+    {
+        static std::vector<char> pattern;
+        static std::once_flag once;
+        std::call_once(once, []()
             {
-                _range_pos = _list.size();
-                start = _list[_list.size() - 1] + 2;
-            }
-            else
+                pattern.resize(15015, 0);
+                for (int p : {3, 5, 7, 11, 13})
+                    for (int m = (p - 1)/2; m < 15015; m += p)
+                        pattern[m] = 1;
+            });
+        return pattern;
+    }
+
+    PrimeSieve::PrimeSieve(uint64_t start, uint64_t end, int threads, size_t segment_size) : _start(start), _end(end), _segment_size(segment_size)
+    {
+        // Odd numbers 2m + 1 with _first <= m < end/2.
+        _first = start/2;
+        _segment_count = end/2 > _first ? (end/2 - _first + _segment_size - 1)/_segment_size : 0;
+
+        uint64_t sqrt_end = (uint64_t)std::sqrt((double)end);
+        if (sqrt_end > 0xFFFFFFFF)
+            sqrt_end = 0xFFFFFFFF;
+        while (sqrt_end*sqrt_end > end)
+            sqrt_end--;
+        while (sqrt_end < 0xFFFFFFFF && (sqrt_end + 1)*(sqrt_end + 1) <= end)
+            sqrt_end++;
+        std::vector<bool> bitmap(sqrt_end/2 + 1, false);
+        for (uint64_t m = 1; m < bitmap.size(); m++)
+            if (!bitmap[m])
             {
-                _range_pos += _range.size();
-                start = _range[_range.size() - 1] + 2;
+                uint64_t p = 2*m + 1;
+                _base.push_back((uint32_t)p);
+                for (uint64_t j = (p*p - 1)/2; j < bitmap.size(); j += p)
+                    bitmap[j] = true;
             }
-            int range = _list[_list.size() - 1];
-            if (start < (int)((1UL << 31) - range))
-                _list.sieve_range(start, start + range, _range);
-            else
+        wheel_pattern();
+
+        if (threads > 0 && _segment_count > 1)
+        {
+            _slot_count = 2*threads;
+            _slots.reset(new Slot[_slot_count]);
+            for (size_t i = 0; i < _slot_count; i++)
+                _slots[i].seq = i;
+            for (int i = 0; i < threads; i++)
+                _threads.emplace_back(&PrimeSieve::run, this);
+        }
+
+        if (start <= 2 && 2 < end)
+        {
+            _cur = 2;
+            _primes.push_back(2);
+        }
+        else
+            ++(*this);
+    }
+
+    PrimeSieve::~PrimeSieve()
+    {
+        _stop = true;
+        for (auto& thread : _threads)
+            thread.join();
+    }
+
+    void PrimeSieve::sieve_segment(uint64_t index, std::vector<char>& bitmap, std::vector<uint64_t>& primes)
+    {
+        uint64_t lo = _first + index*_segment_size;
+        uint64_t hi = lo + _segment_size < _end/2 ? lo + _segment_size : _end/2;
+        size_t size = (size_t)(hi - lo);
+        const std::vector<char>& pattern = wheel_pattern();
+
+        bitmap.resize(size);
+        size_t offset = (size_t)(lo%15015);
+        for (size_t i = 0; i < size; )
+        {
+            size_t count = 15015 - offset < size - i ? 15015 - offset : size - i;
+            memcpy(bitmap.data() + i, pattern.data() + offset, count);
+            i += count;
+            offset = 0;
+        }
+        for (uint64_t p : {3, 5, 7, 11, 13})
+            if ((p - 1)/2 >= lo && (p - 1)/2 < hi)
+                bitmap[(size_t)((p - 1)/2 - lo)] = 0;
+        if (lo == 0 && size > 0)
+            bitmap[0] = 1;
+
+        for (uint64_t p : _base)
+        {
+            if (p <= 13)
+                continue;
+            uint64_t m = (p*p - 1)/2;
+            if (m >= hi)
+                break;
+            if (m < lo)
+                m = lo + ((p - 1)/2 + p - lo%p)%p;
+            for (size_t i = (size_t)(m - lo); i < size; i += (size_t)p)
+                bitmap[i] = 1;
+        }
+
+        primes.clear();
+        for (size_t i = 0; i < size; i++)
+            if (!bitmap[i])
+                primes.push_back(2*(lo + i) + 1);
+    }
+
+    void PrimeSieve::run()
+    {
+        std::vector<char> bitmap;
+        while (true)
+        {
+            uint64_t index = _next_segment++;
+            if (index >= _segment_count)
+                return;
+            Slot& slot = _slots[index%_slot_count];
+            while (slot.seq.load(std::memory_order_acquire) != index)
             {
-                _list.sieve_range(start, (int)((1UL << 31) - 1), _range);
-                _range.push_back((int)((1UL << 31) - 1));
+                if (_stop)
+                    return;
+                std::this_thread::yield();
             }
+            sieve_segment(index, bitmap, slot.primes);
+            slot.seq.store(index + 1, std::memory_order_release);
         }
-        return *this;
     }
 
-    std::unique_ptr<PrimeIterator> _iter105097564;
-
-    const PrimeIterator& PrimeIterator::max()
+    bool PrimeSieve::next_segment()
     {
-        if (!_iter105097564)
+        if (_segment >= _segment_count)
+            return false;
+        if (_threads.empty())
+            sieve_segment(_segment, _bitmap, _primes);
+        else
         {
-            _iter105097564.reset(new PrimeIterator(PrimeList::primes_16bit()));
-            _iter105097564->_cur = 105097564;
-            _iter105097564->_range_pos = 105097564;
-            _iter105097564->_range.push_back((int)((1UL << 31) - 1));
+            Slot& slot = _slots[_segment%_slot_count];
+            while (slot.seq.load(std::memory_order_acquire) != _segment + 1)
+                std::this_thread::yield();
+            _primes.swap(slot.primes);
+            slot.seq.store(_segment + _slot_count, std::memory_order_release);
         }
-        return *_iter105097564;
+        _segment++;
+        _pos = 0;
+        return true;
     }
 
-    void PrimeIterator::sieve_range(uint64_t start, uint64_t end, std::vector<uint64_t>& list)
+    PrimeSieve& PrimeSieve::operator++()
     {
-        sieve_range_t<uint64_t, PrimeIterator>(start, end, list, *this, max());
+        if (_done)
+            return *this;
+        _pos++;
+        if (_primes.empty())
+            _pos = 0;
+        while (_pos >= _primes.size())
+            if (!next_segment())
+            {
+                _done = true;
+                return *this;
+            }
+        _cur = _primes[_pos];
+        return *this;
     }
 }
@@ -3,6 +3,8 @@
 #include <vector>
 #include <iterator>
 #include <memory>
+#include <thread>
+#include <atomic>
 
 namespace arithmetic
 {
@@ -22,48 +24,80 @@ namespace arithmetic
     inline int kronecker(int a, int b) { return kronecker((uint32_t)a, (uint32_t)b); }
 
     class PrimeIterator;
+    class PrimeSieve;
 
     class PrimeList
     {
         friend class PrimeIterator;
 
+    public:
+        // Absolute value stored every CHECKPOINT primes, halved gaps in between.
+        static const int CHECKPOINT = 64;
+
+        class const_iterator
+        {
+        public:
+            const_iterator(const PrimeList& list, size_t pos) : _list(&list), _pos(pos), _value(pos < list.size() ? list[pos] : 0) { }
+
+            int operator*() const { return _value; }
+            const_iterator& operator++() { _value = _list->next(_pos++, _value); return *this; }
+            void operator++(int) { ++(*this); }
+            bool operator==(const const_iterator& other) const { return _pos == other._pos; }
+            bool operator!=(const const_iterator& other) const { return _pos != other._pos; }
+            size_t pos() const { return _pos; }
+
+        private:
+            const PrimeList* _list;
+            size_t _pos;
+            int _value;
+        };
+
     public:
         PrimeList(int max);
 
         void sieve_range(int start, int end, std::vector<int>& list);
 
-        size_t size() const { return primes.size(); }
-        int operator[] (size_t pos) const { return primes[pos]; }
+        size_t size() const { return _size; }
+        int operator[] (size_t pos) const;
+        int next(size_t pos, int value) const { return pos + 1 >= _size ? 0 : value == 2 ? 3 : value + 2*_gaps[pos + 1]; }
 
         PrimeIterator begin();
+        const_iterator cbegin() const { return const_iterator(*this, 0); }
+        const_iterator cend() const { return const_iterator(*this, _size); }
 
         static PrimeList& primes_16bit() { if (!_list65536) _list65536.reset(new PrimeList(65536)); return *_list65536; }
 
     private:
-        std::vector<int> primes;
+        size_t _size = 0;
+        std::vector<uint8_t> _gaps;
+        std::vector<int> _checkpoints;
 
         static std::unique_ptr<PrimeList> _list65536;
     };
 
+    // Walks the list, then primes past it in blocks [s, 2s) sieved by PrimeSieve. A copy restarts the sieve
+    // at its current prime when it first steps past it.
     class PrimeIterator
     {
     public:
         using iterator_category = std::input_iterator_tag;
-        using value_type = int;
-        using difference_type = int;
-        using pointer = const int*;
-        using reference = int;
+        using value_type = uint64_t;
+        using difference_type = int64_t;
+        using pointer = const uint64_t*;
+        using reference = uint64_t;
 
     public:
-        PrimeIterator(PrimeList& list) : _list(list) { }
-        PrimeIterator(const PrimeIterator& it) : _list(it._list), _cur(it._cur), _range(it._range), _range_pos(it._range_pos) { }
+        PrimeIterator(PrimeList& list) : _list(list), _value(list.size() > 0 ? list[0] : 0) { }
+        PrimeIterator(const PrimeIterator& it) : _list(it._list), _cur(it._cur), _value(it._value) { }
+        ~PrimeIterator();
         PrimeIterator& operator=(const PrimeIterator& it)
         {
-            _list = it._list; _cur = it._cur; _range = it._range; _range_pos = it._range_pos;
+            _list = it._list; _cur = it._cur; _value = it._value; _sieve.reset();
             return *this;
         }
 
         static PrimeIterator get() { return PrimeIterator(PrimeList::primes_16bit()); }
+        // Sentinel past every prime.
         static const PrimeIterator& max();
 
         void sieve_range(uint64_t start, uint64_t end, std::vector<uint64_t>& list);
@@ -73,13 +107,61 @@ namespace arithmetic
         PrimeIterator& operator+=(int offset);
         bool operator==(const PrimeIterator& other) const { return _cur == other._cur; }
         bool operator!=(const PrimeIterator& other) const { return !(*this == other); }
-        int operator*() const { return _cur < _list.size() ? _list[_cur] : _range[_cur - _range_pos]; }
+        uint64_t operator*() const { return _value; }
         size_t pos() const { return _cur; }
 
+    private:
+        uint64_t next_sieved();
+
     private:
         PrimeList& _list;
         size_t _cur = 0;
-        std::vector<int> _range;
-        size_t _range_pos = 0;
+        uint64_t _value;
+        std::unique_ptr<PrimeSieve> _sieve;
+    };
+    // Segmented sieve of Eratosthenes over uint64_t, odd numbers only with 3..13 removed by a precomputed wheel pattern.
+    // Worker threads sieve segments ahead of the consumer, which takes them in order from a ring of slots.
+    class PrimeSieve
+    {
+    public:
+        PrimeSieve(uint64_t start, uint64_t end, int threads = 0, size_t segment_size = 262144);
+        ~PrimeSieve();
+
+        bool done() const { return _done; }
+        uint64_t operator*() const { return _cur; }
+        PrimeSieve& operator++();
+
+        uint64_t start() const { return _start; }
+        uint64_t end() const { return _end; }
+
+    private:
+        struct Slot
+        {
+            std::atomic<uint64_t> seq;
+            std::vector<uint64_t> primes;
+        };
+
+        void run();
+        void sieve_segment(uint64_t index, std::vector<char>& bitmap, std::vector<uint64_t>& primes);
+        bool next_segment();
+
+    private:
+        uint64_t _start;
+        uint64_t _end;
+        uint64_t _first;
+        size_t _segment_size;
+        uint64_t _segment_count;
+        std::vector<uint32_t> _base;
+        std::unique_ptr<Slot[]> _slots;
+        size_t _slot_count = 0;
+        std::atomic<uint64_t> _next_segment{0};
+        std::atomic<bool> _stop{false};
+        std::vector<std::thread> _threads;
+        uint64_t _segment = 0;
+        std::vector<char> _bitmap;
+        std::vector<uint64_t> _primes;
+        size_t _pos = 0;
+        uint64_t _cur = 0;
+        bool _done = false;
     };
 }
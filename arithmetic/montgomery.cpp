@@ -93,6 +93,25 @@ namespace arithmetic
         return gw().cmp(*a.Y*(*b.Z), *b.Y*(*a.Z));
     }
 
+    bool MontgomeryArithmetic::eq(const EdY& a, const EdY& b)
+    {
+        if (!a.Y || !b.Y)
+            return !a.Y && !b.Y;
+        if (!a.Z && !b.Z)
+            return gw().eq(*a.Y, *b.Y);
+        GWNum tmp(gw());
+        GWNum tmp2(gw());
+        if (b.Z)
+            gw().mul(*a.Y, *b.Z, tmp, GWMUL_FFT_S1 | GWMUL_FFT_S2);
+        else
+            tmp = *a.Y;
+        if (a.Z)
+            gw().mul(*b.Y, *a.Z, tmp2, GWMUL_FFT_S1 | GWMUL_FFT_S2);
+        else
+            tmp2 = *b.Y;
+        return gw().eq(tmp, tmp2);
+    }
+
     void MontgomeryArithmetic::add(EdY& a, EdY& b, EdY& a_minus_b, EdY& res)
     {
         bool safe1 = square_safe(gw().gwdata(), 1);
@@ -207,58 +226,21 @@ namespace arithmetic
     template <typename Iter>
     void MontgomeryArithmetic::normalize(Iter begin, Iter end)
     {
-        Iter it;
-        Iter first = end;
-        Iter last = end;
-        for (it = begin; it != end; it++)
+        Giant divisor = gw().popg();
+        if (!gw().inv(begin, end, [](auto& a) { return a && a->Z ? a->Z.get() : nullptr; }, divisor, GWMUL_STARTNEXTFFT))
+            throw NoInverseException(divisor);
+        for (Iter it = begin; it != end; it++)
         {
             if (!(*it))
                 continue;
-            if (first == end)
-                first = it;
-            last = it;
-            if (!(*it)->Z)
-            {
-                (*it)->Z.reset(new GWNum(gw()));
-                *(*it)->Z = 1;
-            }
-            if (!(*it)->ZpY)
-                (*it)->ZpY.reset(new GWNum(gw()));
-            (*it)->ZmY.reset();
-        }
-        if (first == end)
-            return;
-        std::swap((*first)->ZpY, (*first)->Z);
-        Iter prev = first;
-        for ((it = first)++; it != end; it++)
-            if (*it)
-            {
-                gw().mul(*(*prev)->ZpY, *(*it)->Z, *(*it)->ZpY, it != last ? GWMUL_STARTNEXTFFT : 0);
-                prev = it;
-            }
-        try
-        {
-            gw().inv(*(*last)->ZpY, *(*last)->ZpY);
-        }
-        catch (const ArithmeticException&)
-        {
-            std::swap((*first)->ZpY, (*first)->Z);
-            throw;
-        }
-        for ((it = last)++, prev = last; it != first;)
-        {
-            it = prev;
-            if (it != first)
+            if ((*it)->Z)
             {
-                for ((prev = it)--; !(*prev); prev--);
-                gw().mul(*(*it)->ZpY, *(*prev)->ZpY, *(*prev)->ZpY, GWMUL_STARTNEXTFFT);
-                std::swap((*it)->ZpY, (*prev)->ZpY);
-                gw().mul(*(*it)->Z, *(*prev)->ZpY, *(*prev)->ZpY, GWMUL_STARTNEXTFFT);
+                if ((*it)->Y)
+                    gw().mul(*(*it)->Z, *(*it)->Y, *(*it)->Y, GWMUL_STARTNEXTFFT);
+                (*it)->Z.reset();
             }
-            if ((*it)->Y)
-                gw().mul(*(*it)->ZpY, *(*it)->Y, *(*it)->Y, GWMUL_STARTNEXTFFT);
-            (*it)->Z.reset();
             (*it)->ZpY.reset();
+            (*it)->ZmY.reset();
         }
     }
 
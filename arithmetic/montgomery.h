@@ -23,6 +23,7 @@ namespace arithmetic
         virtual void init(EdY& res) override;
         virtual void init(const EdPoint& a, EdY& res);
         virtual int cmp(const EdY& a, const EdY& b);
+        virtual bool eq(const EdY& a, const EdY& b);
         virtual void add(EdY& a, EdY& b, EdY& a_minus_b, EdY& res) override;
         virtual void dbl(EdY& a, EdY& res) override;
         virtual void optimize(EdY& a) override;
@@ -85,11 +86,11 @@ namespace arithmetic
         }
         friend bool operator == (const EdY& a, const EdY& b)
         {
-            return a.arithmetic().cmp(a, b) == 0;
+            return a.arithmetic().eq(a, b);
         }
         friend bool operator != (const EdY& a, const EdY& b)
         {
-            return a.arithmetic().cmp(a, b) != 0;
+            return !a.arithmetic().eq(a, b);
         }
         EdY& normalize()
         {
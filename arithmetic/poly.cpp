@@ -170,9 +170,11 @@ namespace arithmetic
         if (!res.empty())
             res.pm().free(res);
         res._poly.push_back(a._gwnum);
-        a._gwnum = nullptr;
         res._monic = monic;
         res._freeable = dynamic_cast<GWNumWrapper*>(&a) == nullptr;
+        if (res._freeable && gw().state().pool)
+            gw().state().pool->release();
+        a._gwnum = nullptr;
     }
 
     void PolyMult::init(gwnum* data, size_t size, bool freeable, bool monic, Poly& res)
@@ -1019,15 +1021,16 @@ namespace arithmetic
     {
         res._monic = a.monic();
         res.pm().alloc(res, a.size());
-        for (int i = 0; i < a.size(); i++)
-            if (gwconvert(gw().gwdata(), pm_res.gw().gwdata(), a._poly[i], res._poly[i]) != 0)
-                throw InvalidFFTDataException();
+        if (a.size() > 0 && gwconvert_batch(gw().gwdata(), pm_res.gw().gwdata(), const_cast<gwnum*>(a._poly.data()), res._poly.data(), a.size(), gwget_num_threads(gw().gwdata())) != 0)
+            throw InvalidFFTDataException();
     }
 
     void PolyMult::insert(GWNum&& a, Poly& res, size_t pos)
     {
         GWASSERT(res._freeable);
         res._poly.insert(res._poly.begin() + pos, *a);
+        if (gw().state().pool && dynamic_cast<GWNumWrapper*>(&a) == nullptr)
+            gw().state().pool->release();
         a._gwnum = nullptr;
     }
 
@@ -1036,6 +1039,8 @@ namespace arithmetic
         GWASSERT(a._freeable);
         gwnum res = a._poly.at(pos);
         a._poly.erase(a._poly.begin() + pos);
+        if (gw().state().pool)
+            gw().state().pool->adopt();
         return GWNum(gw(), res);
     }
 }
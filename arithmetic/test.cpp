@@ -1,13 +1,98 @@
 #include <iostream>
+#include <stdexcept>
 
 #include "gwnum.h"
 #include "arithmetic.h"
 #include "lucas.h"
 #include "edwards.h"
 #include "montgomery.h"
+#include "integer.h"
+#include "task.h"
+#include "scheduler.h"
 
 using namespace arithmetic;
 
+class PowermodTestArithmetic : public GiantsArithmetic
+{
+public:
+    using GiantsArithmetic::powermod_gw;
+};
+
+class AutoFlagsTestArithmetic : public GWArithmetic
+{
+public:
+    AutoFlagsTestArithmetic(GWState& state) : GWArithmetic(state) { }
+
+    int consumers(GWNum& a) { auto it = _consumers.find(*a); return it != _consumers.end() ? it->second : -1; }
+    bool tracking() { return !_consumers.empty() || !_auto_ffted.empty(); }
+};
+
+class RollbackTestState : public TaskState
+{
+public:
+    RollbackTestState() : TaskState(1) { }
+
+    void set(int iteration, GWNum& X) { TaskState::set(iteration); _X = X; }
+    bool read(Reader& reader) override { return TaskState::read(reader) && reader.read(_X); }
+    void write(Writer& writer) override { TaskState::write(writer); writer.write(_X); }
+    Giant& X() { return _X; }
+
+private:
+    Giant _X;
+};
+
+// Squares 3 with a snapshot after every iteration. The first pass spoils the words of x at iteration 7,
+// the reliable arithmetic raises restart_flag and the task has to resume from the snapshot without setup().
+class RollbackTestTask : public Task
+{
+public:
+    void init(GWState* gwstate, Logging* logging, int iterations)
+    {
+        Task::init(gwstate, nullptr, nullptr, logging, iterations);
+        _error_check = true;
+        _state_update_period = 1;
+        set_rollback(4, 1 << 20);
+    }
+
+    int setups = 0;
+    int resumed = -1;
+    Giant result;
+
+protected:
+    void setup() override { setups++; }
+    void execute() override
+    {
+        GWNum x(gw());
+        int i = 0;
+        if (state() != nullptr)
+        {
+            i = state()->iteration();
+            x = static_cast<RollbackTestState*>(state())->X();
+            if (_spoiled)
+                resumed = i;
+        }
+        else
+            x = 3;
+        for (; i < iterations(); i++)
+        {
+            if (i == 7 && !_spoiled)
+            {
+                _spoiled = true;
+                for (unsigned long w = 0; w < gw().gwdata()->FFTLEN; w++)
+                    set_fft_value(gw().gwdata(), *x, w, 1L << 40);
+            }
+            gw().square(x, x, 0);
+            commit_execute<RollbackTestState>(i + 1, x);
+        }
+        result = x;
+    }
+    void reinit_gwstate() override { }
+    void release() override { }
+
+private:
+    bool _spoiled = false;
+};
+
 int main(int argc, char *argv[])
 {
     int i;
@@ -123,6 +208,31 @@ int main(int argc, char *argv[])
 
     std::cout << a.to_string() << std::endl;
 
+    // Two-scalar multiplication against two single ones, with and without a normalized dictionary.
+    P = ed.gen_curve(7636607, nullptr);
+    EdPoint Q(P), R(ed), R1(ed), R2(ed);
+    tmp = 1234567;
+    Q *= tmp;
+    Giant sx(giants), sy(giants);
+    for (i = 0; i < 2; i++)
+    {
+        giants.rnd(sx, i == 0 ? 60 : 300);
+        giants.rnd(sy, i == 0 ? 40 : 250);
+        R1 = P;
+        R1 *= sx;
+        R2 = Q;
+        R2 *= sy;
+        if (i == 1)
+        {
+            sy = -std::move(sy);
+            ed.neg(R2, R2);
+        }
+        ed.add(R1, R2, R1);
+        ed.mul(P, sx, Q, sy, R);
+        if (R != R1)
+            printf("Edwards two-scalar mul error\n");
+    }
+
     LucasVArithmetic lucas(gw.carefully());
     LucasV V(lucas), V1(lucas), V2(lucas);
     GWNum lucasP(lucas.gw());
@@ -180,6 +290,457 @@ int main(int argc, char *argv[])
     fft.inv_transform(poly1, poly1);
     for (int i = 7; i >= 0; i--)
         std::cout << poly1[i].to_string() << std::endl;
- 
+
+    // Kronecker symbol against the word-sized one, then reciprocity and squares above the half-gcd threshold.
+    for (i = 0; i < 300; i++)
+        for (int j = 1; j < 300; j += 2)
+        {
+            a = i;
+            b = j;
+            int k = kronecker((uint32_t)i, (uint32_t)j);
+            if (kronecker(a, b) != (k > 1 ? 0 : k))
+                printf("kronecker error %d %d\n", i, j);
+        }
+    Giant c(giants);
+    for (i = 0; i < 20; i++)
+    {
+        giants.rnd(a, 30000 + 1000*i);
+        giants.rnd(b, 20000 + 2000*i);
+        a += a.bit(0) ? 0 : 1;
+        b += b.bit(0) ? 0 : 1;
+        if (gcd(a, b) != 1)
+            continue;
+        int sign = a.bit(1) && b.bit(1) ? -1 : 1;
+        if (kronecker(a, b)*kronecker(b, a) != sign)
+            printf("kronecker reciprocity error\n");
+        giants.rnd(c, 15000);
+        if (gcd(c, b) != 1)
+            continue;
+        c = c*c*a;
+        if (kronecker(c, b) != kronecker(a, b))
+            printf("kronecker square error\n");
+#ifdef GMP
+        GMPArithmetic gmp;
+        Giant ga(gmp), gb(gmp);
+        ga = a;
+        gb = b;
+        if (kronecker(ga, gb) != kronecker(a, b))
+            printf("kronecker GMP error\n");
+#endif
+    }
+
+    // Decimal conversion above the divide-and-conquer threshold: zeros inside the chunks, all nines, round trip.
+    a = 10;
+    a.power(3000);
+    std::string str = a.to_string();
+    if (str.size() != 3001 || str[0] != '1' || str.find_first_not_of('0', 1) != std::string::npos)
+        printf("to_string error\n");
+    a -= 1;
+    if (a.to_string() != std::string(3000, '9'))
+        printf("to_string error\n");
+    for (i = 0; i < 5; i++)
+    {
+        giants.rnd(a, 20000 + 20000*i);
+        if (i & 1)
+            a = -std::move(a);
+        str = a.to_string();
+        b = str;
+        if (a != b)
+            printf("to_string round trip error\n");
+#ifdef GMP
+        GMPArithmetic gmp;
+        Giant ga(gmp);
+        ga = a;
+        if (ga.to_string() != str)
+            printf("to_string GMP error\n");
+#endif
+    }
+
+    // Remainder tree against one modulus at a time, odd count so that a node is carried up unchanged.
+    std::vector<uint32_t> moduli;
+    for (auto it = PrimeList::primes_16bit().cbegin(); moduli.size() < 1001; it++)
+        moduli.push_back(*it);
+    moduli.push_back(4294967291U);
+    moduli.push_back(4294967295U);
+    ProductTree tree(giants, moduli);
+    std::vector<uint32_t> rems;
+    for (i = 0; i < 4; i++)
+    {
+        giants.rnd(a, i < 2 ? 1000 : 50000);
+        if (i & 1)
+            a = -std::move(a);
+        tree.mod(a, rems);
+        for (size_t j = 0; j < moduli.size(); j++)
+        {
+            uint32_t r = a % moduli[j];
+            if (a < 0 && r != 0)
+                r = moduli[j] - r;
+            if (rems[j] != r || tree.product() % moduli[j] != 0)
+                printf("product tree error %d\n", (int)moduli[j]);
+        }
+    }
+
+    // Segmented sieve against a plain one, single and multithreaded over several segments, low and high ranges.
+    std::vector<bool> composite(2000000, false);
+    composite[0] = composite[1] = true;
+    for (uint64_t p = 2; p*p < composite.size(); p++)
+        if (!composite[p])
+            for (uint64_t j = p*p; j < composite.size(); j += p)
+                composite[j] = true;
+    auto sieve_check = [&](uint64_t start, uint64_t end, int threads)
+    {
+        std::vector<bool> range(end - start, false);
+        for (uint64_t p = 2; p*p < end; p++)
+            if (!composite[p])
+            {
+                uint64_t j = (start + p - 1)/p*p;
+                for (j = j < p*p ? p*p : j; j < end; j += p)
+                    range[j - start] = true;
+            }
+        uint64_t n = start < 2 ? 2 : start;
+        for (PrimeSieve sieve(start, end, threads, 4096); !sieve.done(); ++sieve, n++)
+        {
+            if (*sieve < n || *sieve >= end)
+                return false;
+            for (; n < *sieve; n++)
+                if (!range[n - start])
+                    return false;
+            if (range[n - start])
+                return false;
+        }
+        for (; n < end; n++)
+            if (!range[n - start])
+                return false;
+        return true;
+    };
+    if (!sieve_check(0, 2000000, 0) || !sieve_check(0, 2000000, 4) || !sieve_check(1000003, 1000100, 2) || !sieve_check((1ULL << 40) + 1, (1ULL << 40) + 1000000, 3))
+        printf("prime sieve error\n");
+    PrimeIterator prime_it = PrimeIterator::get();
+    for (uint64_t n = 2; n < composite.size(); n++)
+        if (!composite[n])
+        {
+            if (*prime_it != n)
+            {
+                printf("prime iterator error %d\n", (int)n);
+                break;
+            }
+            ++prime_it;
+        }
+
+    // Gap-encoded list: iteration and random access across checkpoints against the plain sieve, then sieve_range().
+    PrimeList prime_list((int)composite.size());
+    size_t prime_pos = 0;
+    auto list_it = prime_list.cbegin();
+    for (int n = 2; n < (int)composite.size(); n++)
+        if (!composite[n])
+        {
+            if (list_it == prime_list.cend() || *list_it != n || prime_list[prime_pos] != n)
+            {
+                printf("prime list error %d\n", n);
+                break;
+            }
+            list_it++;
+            prime_pos++;
+        }
+    if (list_it != prime_list.cend() || prime_list.size() != prime_pos)
+        printf("prime list size error\n");
+    std::vector<int> primes_range;
+    prime_list.sieve_range(1000000, 1001000, primes_range);
+    prime_pos = 0;
+    for (int n = 1000000; n < 1001000; n++)
+        if (!composite[n] && (prime_pos >= primes_range.size() || primes_range[prime_pos++] != n))
+            printf("prime list sieve_range error %d\n", n);
+    if (prime_pos != primes_range.size())
+        printf("prime list sieve_range error\n");
+
+    // Batch gcd with a known factor planted in one residue, at an inner leaf and at the leaf carried up unchanged.
+    Giant p127(giants), p89(giants);
+    p127 = 1;
+    p127 <<= 127;
+    p127 -= 1;
+    p89 = 1;
+    p89 <<= 89;
+    p89 -= 1;
+    BatchGCD batch(giants, p127*p89);
+    std::vector<Giant> factors;
+    for (int planted : { 5, 36 })
+    {
+        batch.clear();
+        for (i = 0; i < 37; i++)
+        {
+            giants.rnd(c, 250);
+            if (i == planted)
+                c = std::move(c)*p127;
+            batch.add(c);
+        }
+        if (!batch.gcd(a) || a != p127)
+            printf("batch gcd error\n");
+        batch.split(factors);
+        if (factors.size() != 37)
+            printf("batch gcd split error\n");
+        for (i = 0; i < (int)factors.size(); i++)
+            if (i == planted ? factors[i] != p127 : factors[i] != 1)
+                printf("batch gcd split error %d\n", i);
+    }
+
+    // Joint sparse form: digits add up to the scalars, the top column is nonzero, one column of any three is zero,
+    // no row has adjacent digits of opposite signs, and two nonzero digits in a row pair with a nonzero then zero column.
+    std::vector<int8_t> jsf_a, jsf_b;
+    for (i = 0; i < 100; i++)
+    {
+        giants.rnd(a, 1 + 3*i);
+        giants.rnd(b, 300 - 2*i);
+        if (i & 1)
+            a = -std::move(a);
+        if (i & 2)
+            b = -std::move(b);
+        get_JSF(a, b, jsf_a, jsf_b);
+        int n = (int)jsf_a.size();
+        bool ok = jsf_b.size() == jsf_a.size() && n <= (a.bitlen() > b.bitlen() ? a.bitlen() : b.bitlen()) + 1 && (n == 0 || jsf_a[n - 1] != 0 || jsf_b[n - 1] != 0);
+        Giant ra(giants), rb(giants);
+        ra = 0;
+        rb = 0;
+        for (int j = n - 1; ok && j >= 0; j--)
+        {
+            ra <<= 1;
+            ra += jsf_a[j];
+            rb <<= 1;
+            rb += jsf_b[j];
+            if (j + 2 < n && (jsf_a[j] || jsf_b[j]) && (jsf_a[j + 1] || jsf_b[j + 1]) && (jsf_a[j + 2] || jsf_b[j + 2]))
+                ok = false;
+            if (j + 1 < n && (jsf_a[j]*jsf_a[j + 1] == -1 || jsf_b[j]*jsf_b[j + 1] == -1))
+                ok = false;
+            if (j + 1 < n && jsf_a[j]*jsf_a[j + 1] != 0 && (jsf_b[j + 1] == 0 || jsf_b[j] != 0))
+                ok = false;
+            if (j + 1 < n && jsf_b[j]*jsf_b[j + 1] != 0 && (jsf_a[j + 1] == 0 || jsf_a[j] != 0))
+                ok = false;
+        }
+        if (!ok || ra != a || rb != b)
+            printf("JSF error %d\n", i);
+    }
+
+    // Word-level equality: words of b differ from a by j*N, N = 2^4096 + 1, where (2^bits - 1) in every word adds N - 2.
+    GWNum wa(gw), wb(gw);
+    giants.rnd(a, 4000);
+    wa = a;
+    for (int j = -3; j <= 3; j++)
+    {
+        wb = a;
+        for (unsigned long w = 0; w < gw.gwdata()->FFTLEN; w++)
+        {
+            long v;
+            int bits = gw.gwdata()->NUM_B_PER_SMALL_WORD + (is_big_word(gw.gwdata(), w) ? 1 : 0);
+            get_fft_value(gw.gwdata(), *wb, w, &v);
+            set_fft_value(gw.gwdata(), *wb, w, v + j*((1L << bits) - 1) + (w == 0 ? 2*j : 0));
+        }
+        if (!gw.eq(wa, wb) || gw.cmp(wa, wb) != 0)
+            printf("eq_words error %d\n", j);
+    }
+    wb = a;
+    wb += 1;
+    if (gw.eq(wa, wb) || gw.cmp(wa, wb) == 0)
+        printf("eq_words error\n");
+
+    // Reliable restart rolls back to the newest in-memory snapshot.
+    Logging rollback_logging(Logging::LEVEL_ERROR);
+    RollbackTestTask rollback_task;
+    rollback_task.init(&gwstate, &rollback_logging, 20);
+    rollback_task.run();
+    wa = 3;
+    for (i = 0; i < 20; i++)
+        gw.square(wa, wa, 0);
+    tmp = wa;
+    if (rollback_task.setups != 1 || rollback_task.resumed != 7 || rollback_task.result != tmp)
+        printf("rollback error\n");
+
+    // gwnum powermod against powermodg, the dispatch is off so that powermod() takes the giants path.
+    PowermodTestArithmetic pm;
+    Giant pa(pm), pe(pm), pn(pm), pr(pm), pr_gw(pm);
+    int powermod_bits = GiantsArithmetic::powermod_gw_bits;
+    GiantsArithmetic::powermod_gw_bits = 0;
+    for (i = 0; i < 4; i++)
+    {
+        pm.rnd(pn, 1500 + 1000*i);
+        pn += pn.bit(0) ? 0 : 1;
+        pm.rnd(pa, 1400 + 1000*i);
+        pm.rnd(pe, 100 + 300*i);
+        pm.powermod(pa, pe, pn, pr);
+        try
+        {
+            pm.powermod_gw(pa, pe, pn, pr_gw);
+            if (pr_gw != pr)
+                printf("powermod_gw error %d\n", i);
+        }
+        catch (const ArithmeticException&)
+        {
+            printf("powermod_gw roundoff error %d\n", i);
+        }
+    }
+    GiantsArithmetic::powermod_gw_bits = powermod_bits;
+
+    // Scheduler: workers run single-threaded clones of the state, a failing job is counted and its exception kept.
+    Scheduler scheduler(gwstate, 3, 0, false);
+    std::vector<Giant> scheduled(24);
+    for (i = 0; i < 24; i++)
+        scheduler.submit([i, &scheduled](Scheduler::Worker& worker)
+            {
+                if (i == 5)
+                    throw std::runtime_error("job 5");
+                GWNum x(worker.gw());
+                x = 3;
+                for (int j = 0; j < i; j++)
+                    worker.gw().square(x, x, 0);
+                scheduled[i] = x;
+            });
+    scheduler.wait();
+    wa = 3;
+    for (i = 0; i < 24; i++)
+    {
+        tmp = wa;
+        if (i != 5 && scheduled[i] != tmp)
+            printf("scheduler error %d\n", i);
+        gw.square(wa, wa, 0);
+    }
+    if (scheduler.completed() != 23 || scheduler.failed() != 1 || scheduler.errors().size() != 1)
+        printf("scheduler count error\n");
+    for (i = 0; i < scheduler.worker_count(); i++)
+        if (scheduler.worker(i).gwstate().thread_count != 1)
+            printf("scheduler thread count error\n");
+
+    // DAC database: generate, save, load, the loaded table gives the same d for every prime and vouches for all of them.
+    DACDatabase dac_generated, dac_loaded;
+    if (!dac_generated.generate(30000, 3) || !dac_generated.save("dactest.bin") || !dac_loaded.load("dactest.bin"))
+        printf("DAC database error\n");
+    else
+    {
+        PrimeList dac_primes(30001);
+        if (dac_loaded.size() != dac_primes.size() || dac_loaded.max_prime() != 30000)
+            printf("DAC database size error\n");
+        for (auto it = dac_primes.cbegin(); it != dac_primes.cend(); it++)
+            if (*it >= 14 && (dac_loaded.d(*it, (int)it.pos()) == 0 || dac_loaded.d(*it, (int)it.pos()) != dac_generated.d(*it, (int)it.pos())))
+                printf("DAC database error %d\n", *it);
+        if (dac_loaded.d(30011, (int)dac_primes.size() - 1) != 0)
+            printf("DAC database bound error\n");
+    }
+    dac_loaded.close();
+    remove("dactest.bin");
+
+    // Fused expressions against the plain operators. Options given to cd of a*b + c*d apply to c and d.
+    GWNum fa(gw), fb(gw), fc(gw), fd(gw), fres(gw);
+    giants.rnd(a, 4000);
+    fa = a;
+    giants.rnd(a, 4000);
+    fb = a;
+    giants.rnd(a, 4000);
+    fc = a;
+    giants.rnd(a, 4000);
+    fd = a;
+    fres = fused(fa)*fb + fc;
+    if (fres != fa*fb + fc)
+        printf("fused a*b + c error\n");
+    fres = fused(fa)*fb - fc;
+    if (fres != fa*fb - fc)
+        printf("fused a*b - c error\n");
+    fres = (fused(fa) + fb)*fc;
+    if (fres != (fa + fb)*fc)
+        printf("fused (a + b)*c error\n");
+    fres = (fused(fa) - fb)*fc;
+    if (fres != (fa - fb)*fc)
+        printf("fused (a - b)*c error\n");
+    fres = fused(fa)*fb + fused(fc)*fd;
+    if (fres != fa*fb + fc*fd)
+        printf("fused a*b + c*d error\n");
+    fres = fused(fa)*fb - fused(fc)*fd;
+    if (fres != fa*fb - fc*fd)
+        printf("fused a*b - c*d error\n");
+    gw.unfft(fc, fc);
+    auto fused_preserve = fused(fa)*fb + (fused(fc)*fd).options(GWMUL_FFT_S1 | GWMUL_PRESERVE_S1 | GWMUL_FFT_S2);
+    if ((fused_preserve._options & (GWMUL_FFT_S3 | GWMUL_PRESERVE_S3 | GWMUL_FFT_S4)) != (GWMUL_FFT_S3 | GWMUL_PRESERVE_S3 | GWMUL_FFT_S4) || (fused_preserve._options & (GWMUL_PRESERVE_S1 | GWMUL_STARTNEXTFFT)))
+        printf("fused options error\n");
+    fres = fused_preserve;
+    if (FFT_state(*fc) != NOT_FFTed || fres != fa*fb + fc*fd)
+        printf("fused preserve error\n");
+
+    // Comb against the signed window for both FFT settings, with a scalar longer than bits() and a serialized table.
+    P = ed.gen_curve(7636607, nullptr);
+    for (int comb_fft = 0; comb_fft < 2; comb_fft++)
+    {
+        EdComb comb(ed, P, 300, 4, comb_fft == 1);
+        Writer comb_writer;
+        comb_writer.write(comb);
+        EdComb comb_loaded(ed, comb_fft == 1);
+        Reader comb_reader(0, 0, 0, comb_writer.buffer().data(), (int)comb_writer.buffer().size(), 0);
+        if (!comb_reader.read(comb_loaded))
+            printf("EdComb read error\n");
+        for (i = 0; i < 3; i++)
+        {
+            giants.rnd(sx, i == 2 ? 500 : 290);
+            R1 = P;
+            R1 *= sx;
+            if (i == 1)
+            {
+                sx = -std::move(sx);
+                ed.neg(R1, R1);
+            }
+            comb.mul(sx, R);
+            if (R != R1)
+                printf("EdComb error %d %d\n", comb_fft, i);
+            comb_loaded.mul(sx, R);
+            if (R != R1)
+                printf("EdComb serialization error %d %d\n", comb_fft, i);
+        }
+    }
+
+    // Lockstep stage 1 against one curve at a time, with and without the normalized dictionary.
+    for (i = 0; i < 2; i++)
+    {
+        giants.rnd(sx, i == 0 ? 64 : 600);
+        EdECMStage1 stage1(gwstate, 5, 2);
+        stage1.run(sx, 7636607);
+        for (int k = 0; k < stage1.curves(); k++)
+        {
+            try
+            {
+                R1 = ed.gen_curve(7636607 + k, nullptr);
+                ed.mul(R1, sx, R);
+                sy = *R.X;
+            }
+            catch (const NoInverseException& e)
+            {
+                sy = e.divisor;
+            }
+            if (stage1.residues()[k] != sy)
+                printf("EdECMStage1 error %d %d\n", i, k);
+        }
+    }
+
+    // Auto flags: a square is one use of its source, turning the mode off forgets all sources.
+    {
+        AutoFlagsTestArithmetic agw(gwstate);
+        GWNum aa(agw), ac(agw), ab(agw), ad(agw), ae(agw);
+        giants.rnd(sx, 1000);
+        giants.rnd(sy, 1000);
+        aa = sx;
+        ac = sy;
+        agw.set_auto_flags(true);
+        agw.expect(aa, 2);
+        agw.square(aa, ab, 0);
+        if (agw.consumers(aa) != 1)
+            printf("auto flags square error\n");
+        agw.mul(aa, ac, ad, 0);
+        if (agw.consumers(aa) != 0)
+            printf("auto flags mul error\n");
+        agw.expect(ac, 3);
+        agw.set_auto_flags(false);
+        if (agw.tracking())
+            printf("auto flags reset error\n");
+        agw.mul(aa, aa, ae);
+        if (ab != ae)
+            printf("auto flags square value error\n");
+        agw.mul(aa, ac, ae);
+        if (ad != ae)
+            printf("auto flags mul value error\n");
+    }
+
     return 0;
 }
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include "gwnum.h"
 #include "file.h"
+#include "edwards.h"
 #include "md5.h"
 #include "inputnum.h"
 #include "task.h"
@@ -40,6 +41,34 @@ void Writer::write(const arithmetic::SerializedGWNum& value)
     write((const char*)value.data(), value.size()*sizeof(uint32_t));
 }
 
+void Writer::write(const arithmetic::GWNum& value)
+{
+    write((uint32_t)arithmetic::SerializedGWNum::size(value));
+    arithmetic::SerializedGWNum::serialize(value, [&](const uint32_t* data, size_t size) { write((const char*)data, size*sizeof(uint32_t)); });
+}
+
+void Writer::write(const arithmetic::EdComb& value)
+{
+    write((int32_t)value.teeth());
+    write((int32_t)value.columns());
+    arithmetic::GWNum tmp(value.arithmetic().gw());
+    // T = X*Y is recomputed on read.
+    for (auto& p : value.table())
+        for (auto coord : { p->X.get(), p->Y.get() })
+        {
+            if (value.fft())
+                value.arithmetic().gw().unfft(*coord, tmp);
+            else
+                tmp = *coord;
+            write(tmp);
+        }
+}
+
+void StreamWriter::write(const char* ptr, size_t count)
+{
+    _stream.write(ptr, count);
+}
+
 void Writer::write_text(const char* ptr)
 {
     write(ptr, strlen(ptr));
@@ -156,6 +185,42 @@ bool Reader::read(arithmetic::SerializedGWNum& value)
     return true;
 }
 
+bool Reader::read(arithmetic::GWNum& value)
+{
+    if (_size < _pos + 4)
+        return false;
+    int len = *(int32_t*)(_data + _pos);
+    _pos += 4;
+    if (len < 0 || (size_t)_size < (size_t)_pos + (size_t)len*sizeof(uint32_t))
+        return false;
+    arithmetic::SerializedGWNum::deserialize((uint32_t*)(_data + _pos), len, value);
+    _pos += (size_t)len*sizeof(uint32_t);
+    return true;
+}
+
+bool Reader::read(arithmetic::EdComb& value)
+{
+    int32_t teeth, columns;
+    if (!read(teeth) || !read(columns) || teeth <= 0 || teeth >= 16 || columns <= 0)
+        return false;
+    bool fft = value.fft();
+    value.init(teeth, columns, fft);
+    arithmetic::GWArithmetic& gw = value.arithmetic().gw();
+    for (auto& p : value.table())
+    {
+        if (!read(*p->X) || !read(*p->Y))
+            return false;
+        gw.mul(*p->X, *p->Y, *p->T, GWMUL_FFT_S1 | GWMUL_FFT_S2);
+        if (fft)
+        {
+            gw.fft(*p->X, *p->X);
+            gw.fft(*p->Y, *p->Y);
+            gw.fft(*p->T, *p->T);
+        }
+    }
+    return true;
+}
+
 bool TextReader::read_textline(std::string& value)
 {
     int i;
@@ -7,7 +7,15 @@
 namespace arithmetic
 {
     class Giant;
+    class GWNum;
     class SerializedGWNum;
+    class EdComb;
+}
+
+namespace container
+{
+    class FileContainer;
+    class WriteStream;
 }
 
 class Writer
@@ -25,6 +33,8 @@ public:
     void write(const std::string& value);
     void write(const arithmetic::Giant& value);
     void write(const arithmetic::SerializedGWNum& value);
+    void write(const arithmetic::GWNum& value);
+    void write(const arithmetic::EdComb& value);
 
     void write_text(const char* ptr);
     void write_text(const std::string& value);
@@ -39,6 +49,18 @@ private:
     std::vector<char> _buffer;
 };
 
+class StreamWriter : public Writer
+{
+public:
+    StreamWriter(container::WriteStream& stream) : _stream(stream) { }
+
+    void write(const char* ptr, size_t count) override;
+    using Writer::write;
+
+private:
+    container::WriteStream& _stream;
+};
+
 class Reader
 {
 public:
@@ -51,6 +73,8 @@ public:
     bool read(std::string& value);
     bool read(arithmetic::Giant& value);
     bool read(arithmetic::SerializedGWNum& value);
+    bool read(arithmetic::GWNum& value);
+    bool read(arithmetic::EdComb& value);
 
     char type() { return _type; }
     char version() { return _version; }
@@ -135,11 +159,6 @@ public:
     void commit_writer(Writer& /*writer*/) override { }
 };
 
-namespace container
-{
-    class FileContainer;
-}
-
 class FilePacked : public File
 {
 public:
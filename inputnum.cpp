@@ -99,7 +99,7 @@ int get_prime(int n)
         return 1;
     PrimeIterator primes = PrimeIterator::get();
     for (int i = 1; i < n; i++, primes++);
-    return *primes;
+    return (int)*primes;
 }
 
 template<class It>
@@ -441,7 +441,7 @@ bool InputNum::parse(const std::string& s, bool c_required)
             tmp = 1;
             int last = 1;
             PrimeIterator primes = PrimeIterator::get();
-            for (uint32_t i = 0; prime ? i < n : *primes <= (int)n; i++, primes++)
+            for (uint32_t i = 0; prime ? i < n : *primes <= (uint64_t)n; i++, primes++)
             {
                 last = *primes;
                 tmp *= last;
@@ -592,6 +592,27 @@ void factorize(Giant& N, std::vector<std::pair<arithmetic::Giant, int>>& factors
         tmp >>= i;
     }
     std::vector<bool> bitmap;
+    // Large numbers are reduced by a whole block of primes at once with a remainder tree, smaller ones by SmallPrimeBatch.
+    std::vector<uint32_t> primes;
+    std::vector<uint32_t> residues;
+    auto trial_divide = [&]()
+    {
+        bool batch = is_factor == nullptr && primes.size() > 1 && tmp.size() > 64;
+        if (batch)
+            tmp.arithmetic().mod(tmp, primes, residues);
+        uint32_t divisible = 0;
+        for (size_t k = 0; k < primes.size(); k++)
+        {
+            if (!batch && is_factor == nullptr && k%SmallPrimeBatch::LANES == 0)
+                divisible = SmallPrimeBatch(primes.data() + k, (int)std::min(primes.size() - k, (size_t)SmallPrimeBatch::LANES)).divisible(tmp);
+            if (batch ? residues[k] == 0 : is_factor != nullptr ? is_factor(tmp, primes[k]) : (divisible & (1 << (k%SmallPrimeBatch::LANES))) != 0)
+            {
+                for (power = 1, tmp /= primes[k]; tmp%primes[k] == 0; power++, tmp /= primes[k]);
+                add_factor(factors, primes[k], power);
+            }
+        }
+        primes.clear();
+    };
     if (tmp > 1)
     {
         bitmap.resize((size_t)1 << (s - 1), false);
@@ -603,12 +624,9 @@ void factorize(Giant& N, std::vector<std::pair<arithmetic::Giant, int>>& factors
                 if (i < ((size_t)1 << (s/2 - 1)))
                     for (; smallprimes.back().second < bitmap.size(); smallprimes.back().second += smallprimes.back().first)
                         bitmap[smallprimes.back().second] = true;
-                if ((is_factor != nullptr && is_factor(tmp, i*2 + 1)) || (is_factor == nullptr && tmp%(i*2 + 1) == 0))
-                {
-                    for (power = 1, tmp /= i*2 + 1; tmp%(i*2 + 1) == 0; power++, tmp /= i*2 + 1);
-                    add_factor(factors, i*2 + 1, power);
-                }
+                primes.push_back(i*2 + 1);
             }
+        trial_divide();
         if (tmp > 1 && tmp < (1 << (2*s)))
         {
             add_factor(factors, tmp, 1);
@@ -621,11 +639,9 @@ void factorize(Giant& N, std::vector<std::pair<arithmetic::Giant, int>>& factors
                 for (; it->second < bitmap.size(); it->second += it->first)
                     bitmap[it->second] = true;
             for (i = 1 << (s - 1 + j); i < bitmap.size(); i++)
-                if (!bitmap[i] && ((is_factor != nullptr && is_factor(tmp, i*2 + 1)) || (is_factor == nullptr && tmp%(i*2 + 1) == 0)))
-                {
-                    for (power = 1, tmp /= i*2 + 1; tmp%(i*2 + 1) == 0; power++, tmp /= i*2 + 1);
-                    add_factor(factors, i*2 + 1, power);
-                }
+                if (!bitmap[i])
+                    primes.push_back(i*2 + 1);
+            trial_divide();
             if (tmp > 1 && (uint32_t)tmp.bitlen() <= 2*(s - 1 + (j + 5 < s ? j + 5 : s)))
             {
                 add_factor(factors, tmp, 1);
@@ -1233,7 +1249,7 @@ void InputNum::factorize_f_p()
         for (; i <= _n; i += _multifactorial)
         {
             uint32_t j = i;
-            for (auto it = PrimeIterator::get(); (*it)*(*it) <= (int)j; it++)
+            for (auto it = PrimeIterator::get(); (*it)*(*it) <= j; it++)
                 if (j%(*it) == 0)
                 {
                     int& power = factors[*it];
@@ -1249,7 +1265,7 @@ void InputNum::factorize_f_p()
     }
     if (_type == PRIMORIAL)
     {
-        for (auto it = PrimeIterator::get(); *it <= (int)_n; it++)
+        for (auto it = PrimeIterator::get(); *it <= (uint64_t)_n; it++)
             factors[*it]++;
     }
 
@@ -1317,7 +1333,7 @@ void InputNum::print_info()
         {
             PrimeIterator it = PrimeIterator::get();
             int sqrt_n = (int)std::sqrt(n);
-            for (; n%(*it) != 0 && *it < sqrt_n; it++);
+            for (; n%(*it) != 0 && (int)*it < sqrt_n; it++);
             if (n%(*it) == 0)
                 l = *it;
         }
@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include "gwnum.h"
+#include "scheduler.h"
+#include "exception.h"
+#ifdef _WIN32
+#include "windows.h"
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace arithmetic;
+
+void Scheduler::Worker::setup(InputNum& input)
+{
+    _gw.reset();
+    _gwstate.done();
+    _gwstate.thread_count = 1;
+    input.setup(_gwstate);
+    _gw.reset(new GWArithmetic(_gwstate));
+}
+
+Scheduler::Scheduler(GWState& prototype, int worker_count, int first_core, bool pin_threads) : _prototype(prototype)
+{
+    _start = std::chrono::system_clock::now();
+    for (int i = 0; i < worker_count; i++)
+    {
+        _workers.emplace_back(new Worker(i, first_core + i));
+        Worker& worker = *_workers.back();
+        if (prototype.N)
+        {
+            // Same number for all workers, share the FFT tables.
+            worker._gwstate.clone(prototype);
+            worker._gwstate.thread_count = 1;
+            gwset_num_threads(worker._gwstate.gwdata(), 1);
+            worker._gw.reset(new GWArithmetic(worker._gwstate));
+        }
+        else
+            worker._gwstate.copy(prototype);
+        // One test per core.
+        worker._gwstate.thread_count = 1;
+    }
+    for (auto& worker : _workers)
+    {
+        Worker* w = worker.get();
+        w->_thread = std::thread([this, w]() { run(*w); });
+        if (pin_threads)
+            pin(w->_thread, w->core());
+    }
+}
+
+Scheduler::~Scheduler()
+{
+    stop();
+}
+
+void Scheduler::pin(std::thread& thread, int core)
+{
+#ifdef _WIN32
+    SetThreadAffinityMask(thread.native_handle(), (DWORD_PTR)1 << core);
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#endif
+}
+
+void Scheduler::submit(Job job)
+{
+    Worker* worker;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        worker = _workers[_next_worker].get();
+        _next_worker = (_next_worker + 1)%_workers.size();
+        _pending++;
+    }
+    {
+        std::lock_guard<std::mutex> lock(worker->_mutex);
+        worker->_queue.push_back(std::move(job));
+    }
+    // Counted under _mutex after the push, so a worker that found no job waits only until this notification.
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queued++;
+        _work_available.notify_one();
+    }
+}
+
+void Scheduler::submit(const InputNum& input, std::function<void(InputNum& input, Worker& worker)> run)
+{
+    std::shared_ptr<InputNum> number(new InputNum());
+    *number = input;
+    submit([number, run](Worker& worker)
+        {
+            worker.setup(*number);
+            run(*number, worker);
+        });
+}
+
+bool Scheduler::pop(Worker& worker, Job& job)
+{
+    bool found = false;
+    {
+        std::lock_guard<std::mutex> lock(worker._mutex);
+        if (!worker._queue.empty())
+        {
+            job = std::move(worker._queue.front());
+            worker._queue.pop_front();
+            found = true;
+        }
+    }
+    for (size_t i = 1; i < _workers.size() && !found; i++)
+    {
+        Worker& victim = *_workers[(worker.index() + i)%_workers.size()];
+        std::lock_guard<std::mutex> lock(victim._mutex);
+        if (!victim._queue.empty())
+        {
+            job = std::move(victim._queue.back());
+            victim._queue.pop_back();
+            found = true;
+        }
+    }
+    if (found)
+    {
+        // May run before submit() counts the job, _queued dips below zero for a moment.
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queued--;
+    }
+    return found;
+}
+
+void Scheduler::run(Worker& worker)
+{
+    Job job;
+    while (true)
+    {
+        if (!pop(worker, job))
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _work_available.wait(lock, [this]() { return _stop || _queued > 0; });
+            if (_stop)
+                return;
+            continue;
+        }
+        std::exception_ptr error;
+        try
+        {
+            job(worker);
+            worker._completed++;
+            _completed++;
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+            _failed++;
+        }
+        job = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (error)
+                _errors.push_back(error);
+            _pending--;
+        }
+        _work_done.notify_all();
+    }
+}
+
+void Scheduler::wait()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _work_done.wait(lock, [this]() { return _pending == 0; });
+}
+
+void Scheduler::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_stop)
+            return;
+        _stop = true;
+    }
+    _work_available.notify_all();
+    for (auto& worker : _workers)
+        if (worker->_thread.joinable())
+            worker->_thread.join();
+}
+
+double Scheduler::throughput()
+{
+    double hours = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - _start).count()/3600000.0;
+    return hours > 0 ? _completed/hours : 0.0;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include "arithmetic.h"
+#include "inputnum.h"
+
+// Runs many independent tests at once, one per core. Each worker owns its GWState,
+// pulls jobs from its own queue and steals from the other workers when it runs dry.
+class Scheduler
+{
+public:
+    class Worker
+    {
+        friend class Scheduler;
+    public:
+        Worker(int index, int core) : _index(index), _core(core) { }
+
+        int index() { return _index; }
+        int core() { return _core; }
+        arithmetic::GWState& gwstate() { return _gwstate; }
+        arithmetic::GWArithmetic& gw() { return *_gw; }
+        uint64_t completed() { return _completed; }
+
+        void setup(InputNum& input);
+
+    private:
+        int _index;
+        int _core;
+        arithmetic::GWState _gwstate;
+        std::unique_ptr<arithmetic::GWArithmetic> _gw;
+        std::deque<std::function<void(Worker&)>> _queue;
+        std::mutex _mutex;
+        std::thread _thread;
+        std::atomic<uint64_t> _completed{0};
+    };
+
+    using Job = std::function<void(Worker& worker)>;
+
+public:
+    Scheduler(arithmetic::GWState& prototype, int worker_count, int first_core = 0, bool pin = true);
+    ~Scheduler();
+
+    void submit(Job job);
+    void submit(const InputNum& input, std::function<void(InputNum& input, Worker& worker)> run);
+    void wait();
+    void stop();
+
+    int worker_count() { return (int)_workers.size(); }
+    Worker& worker(int index) { return *_workers[index]; }
+    uint64_t completed() { return _completed; }
+    uint64_t failed() { return _failed; }
+    // Exceptions thrown by failed jobs, in the order they were caught. Read after wait().
+    const std::vector<std::exception_ptr>& errors() { return _errors; }
+    double throughput();
+
+private:
+    void run(Worker& worker);
+    bool pop(Worker& worker, Job& job);
+    static void pin(std::thread& thread, int core);
+
+private:
+    arithmetic::GWState& _prototype;
+    std::vector<std::unique_ptr<Worker>> _workers;
+    std::mutex _mutex;
+    std::condition_variable _work_available;
+    std::condition_variable _work_done;
+    int _next_worker = 0;
+    uint64_t _pending = 0;
+    int64_t _queued = 0;
+    std::atomic<uint64_t> _completed{0};
+    std::atomic<uint64_t> _failed{0};
+    std::vector<std::exception_ptr> _errors;
+    bool _stop = false;
+    std::chrono::system_clock::time_point _start;
+};
@@ -103,6 +103,17 @@ void Task::run()
                         opstr += " " + std::to_string(*it);
                 opstr += ".\n";
                 _logging->debug(opstr.data());
+                if (i == 1 && restore_snapshot())
+                {
+                    reliable->restart(_restart_op);
+                    if (rollback())
+                    {
+                        _logging->debug("rolled back to iteration %d.\n", _state->iteration());
+                        continue;
+                    }
+                    i = 0;
+                    continue;
+                }
                 reliable->restart(i == 1 ? _restart_op : 0);
                 i = 0;
                 continue;
@@ -189,6 +200,55 @@ void Task::on_state()
     _logging->heartbeat();
 }
 
+void Task::take_snapshot(std::function<TaskState*()> create)
+{
+    // Reuse the buffer of the oldest snapshot once the ring is full.
+    std::vector<char> buffer;
+    if (!_snapshots.empty() && (int)_snapshots.size() >= _rollback_count)
+    {
+        buffer = std::move(_snapshots.front().data);
+        _snapshots_size -= buffer.size();
+        _snapshots.pop_front();
+        buffer.clear();
+    }
+    Writer writer(std::move(buffer));
+    _state->write(writer);
+    _snapshots.emplace_back();
+    Snapshot& snapshot = _snapshots.back();
+    snapshot.iteration = _state->iteration();
+    snapshot.op = _error_check && _gw != nullptr ? dynamic_cast<ReliableGWArithmetic*>(_gw)->op() : 0;
+    snapshot.data = std::move(writer.buffer());
+    snapshot.create = create;
+    _snapshots_size += snapshot.data.size();
+    while (!_snapshots.empty() && ((int)_snapshots.size() > _rollback_count || _snapshots_size > _rollback_budget))
+    {
+        _snapshots_size -= _snapshots.front().data.size();
+        _snapshots.pop_front();
+    }
+}
+
+bool Task::restore_snapshot()
+{
+    int iteration = _state ? _state->iteration() : 0;
+    // Snapshot may be bad if the task failed again before getting past it.
+    while (!_snapshots.empty() && (_snapshots.back().iteration > iteration || _snapshots.back().iteration == _rollback_iteration))
+    {
+        _snapshots_size -= _snapshots.back().data.size();
+        _snapshots.pop_back();
+    }
+    if (_snapshots.empty())
+        return false;
+    Snapshot& snapshot = _snapshots.back();
+    std::unique_ptr<TaskState> state(snapshot.create());
+    Reader reader(0, state->type(), state->version(), snapshot.data.data(), (int)snapshot.data.size(), 0);
+    if (!state->read(reader))
+        return false;
+    _state = std::move(state);
+    _rollback_iteration = snapshot.iteration;
+    _restart_op = snapshot.op;
+    return true;
+}
+
 void Task::write_state()
 {
     if (_file != nullptr)
@@ -3,6 +3,8 @@
 #include <chrono>
 #include <stdexcept>
 #include <memory>
+#include <deque>
+#include <functional>
 #include "arithmetic.h"
 #include "inputnum.h"
 #include "file.h"
@@ -82,6 +84,7 @@ public:
     bool is_last(int iteration) { return iteration + 1 - (_state ? _state->iteration() : 0) >= _state_update_period || iteration + 1 == _iterations || abort_flag() || _logging->state_save_flag(); }
     virtual double progress() { return _state ? _state->iteration()/(double)iterations() : 0.0; }
     int ops() { return (int)(_op_count + (_gw != nullptr ? _gwstate->ops() - _op_base : 0)); }
+    void set_rollback(int count, size_t memory_budget) { _rollback_count = count; _rollback_budget = memory_budget; _snapshots.clear(); _snapshots_size = 0; }
 
 protected:
     virtual void init(arithmetic::GWState* gwstate, File* file, TaskState* state, Logging* logging, int iterations);
@@ -89,6 +92,9 @@ protected:
     virtual void execute() = 0;
     virtual void reinit_gwstate() = 0;
     virtual void release() = 0;
+    // Called after restore_snapshot() put an in-memory snapshot into state(). Returns true if execute() can continue from it.
+    // The default keeps what setup() built and lets execute() resume from state(), tasks whose setup depends on the state override it.
+    virtual bool rollback() { return true; }
 
     void check();
     void commit_setup();
@@ -108,6 +114,8 @@ protected:
             _tmp_state.reset(new TState());
         static_cast<TState*>(_tmp_state.get())->set(iteration, std::forward<Args>(args)...);
         _tmp_state.swap(_state);
+        if (_rollback_count > 0 && _error_check)
+            take_snapshot([]() { return new TState(); });
         on_state();
     }
     template<class TState>
@@ -118,8 +126,18 @@ protected:
     }
     void on_state();
     virtual void write_state();
+    void take_snapshot(std::function<TaskState*()> create);
+    bool restore_snapshot();
 
 protected:
+    struct Snapshot
+    {
+        int iteration;
+        int op;
+        std::vector<char> data;
+        std::function<TaskState*()> create;
+    };
+
     bool _error_check = false;
     arithmetic::GWState* _gwstate = nullptr;
     arithmetic::GWArithmetic* _gw = nullptr;
@@ -136,6 +154,11 @@ protected:
     int _restart_op = 0;
     double _op_count = 0;
     double _op_base = 0;
+    int _rollback_count = 0;
+    size_t _rollback_budget = 0;
+    std::deque<Snapshot> _snapshots;
+    size_t _snapshots_size = 0;
+    int _rollback_iteration = -1;
 };
 
 class InputTask : public Task